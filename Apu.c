@@ -0,0 +1,643 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "Nes.h"
+
+#define NES ((Nes*)sys) // some syntax de-clutter to compensate for the unfortunate void *sys
+
+// The APU is not clocked along with the CPU. It is caught up to cpu_cycles by Nes_SyncApu() before each
+// access to its registers and at the end of each frame. Catching up jumps from one channel timer clock to
+// the next instead of going cycle by cycle, and channels that can't be heard skip their clocks in one go.
+//
+// Output: every change of a channel level is added to a buffer at the output sample rate as a band
+// limited step (blip synthesis), so there is no aliasing and no per cycle work. Finished samples go to a
+// single producer, single consumer ring that the audio thread drains with Nes_AudioRead(), without locks.
+// If the ring is full the new samples are dropped, emulation never waits for the audio thread.
+
+#define Cpu_clock 1789773 // NTSC
+#define Pi        3.14159265358979323846 // M_PI isn't standard C
+
+#define Blip_phase_bits 5
+#define Blip_phases ( 1 << Blip_phase_bits ) // Fractional sample positions of a step
+#define Blip_taps   16 // Samples covered by a step
+#define Blip_bits   14 // Kernel taps of each phase add up to 1 << Blip_bits
+#define Sync_chunk  8192 // Max CPU cycles added to the delta buffer between flushes
+
+enum { Pulse1, Pulse2, Triangle, Noise, Dmc, Channels };
+
+typedef struct Nes_Audio
+{
+   int rate;
+   uint64_t step;     // Output samples per CPU cycle, 32.32 fixed point
+   long start;        // CPU cycle at position `offset` of `deltas`
+   uint64_t offset;   // 32.32 fixed point
+   int32_t *deltas;   // Band limited steps not yet integrated into samples
+   int capacity;      // Samples in `deltas` besides the Blip_taps tail
+   int32_t integrator;
+   int64_t highpass;  // DC blocker, 16.16 fixed point
+   int level[Channels]; // Last level added of each channel
+
+   short *ring;
+   size_t ring_mask;
+   _Atomic size_t ring_write; // Only advanced by the emulation thread
+   _Atomic size_t ring_read;  // Only advanced by the audio thread
+   _Atomic unsigned long dropped;
+} Nes_Audio;
+
+static const byte length_table[32] = {
+   10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+   12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+static const byte duty_table[4][8] = {
+   { 0, 1, 0, 0, 0, 0, 0, 0 },
+   { 0, 1, 1, 0, 0, 0, 0, 0 },
+   { 0, 1, 1, 1, 1, 0, 0, 0 },
+   { 1, 0, 0, 1, 1, 1, 1, 1 }
+};
+static const word noise_periods[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+static const word dmc_periods[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
+
+// Frame counter events, CPU cycles from the start of the sequence. 4-step and 5-step modes.
+static const long sequence_events[2][4] = { { 7457, 14913, 22371, 29829 }, { 7457, 14913, 22371, 37281 } };
+static const long sequence_length[2] = { 29830, 37282 };
+
+// Linear approximation of the mixer, 16 bit sample units per level step of each channel
+static const int channel_weight[Channels] = { 246, 246, 279, 162, 110 };
+
+// -------------------------------------------------------------------------------
+// Band limited step: windowed sinc impulses at each fractional position, integrated when flushing
+static int32_t blip_kernel[Blip_phases][Blip_taps];
+static pthread_once_t blip_once = PTHREAD_ONCE_INIT;
+
+static void init_blip_kernel( void )
+{
+   for( int phase = 0; phase < Blip_phases; ++phase )
+   {
+      double taps[Blip_taps], sum = 0;
+      for( int i = 0; i < Blip_taps; ++i ) {
+         double x = i - Blip_taps / 2 + 1 - (double) phase / Blip_phases;
+         double sinc = ( x == 0 ) ? 1 : sin( Pi * 0.9 * x ) / ( Pi * 0.9 * x );
+         double w = 2 * Pi * ( x + Blip_taps / 2 ) / Blip_taps; // Blackman window
+         taps[i] = sinc * ( 0.42 - 0.5 * cos( w ) + 0.08 * cos( 2 * w ) );
+         sum += taps[i];
+      }
+      int32_t total = 0;
+      for( int i = 0; i < Blip_taps; ++i ) {
+         blip_kernel[phase][i] = (int32_t) lround( taps[i] / sum * ( 1 << Blip_bits ) );
+         total += blip_kernel[phase][i];
+      }
+      blip_kernel[phase][ Blip_taps / 2 - 1 ] += ( 1 << Blip_bits ) - total; // Exact DC gain
+   }
+}
+
+static inline void add_delta( Nes_Audio *audio, long time, int delta )
+{
+   uint64_t position = audio->offset + (uint64_t)( time - audio->start ) * audio->step;
+   int32_t *dest = &audio->deltas[ position >>32 ];
+   const int32_t *kernel = blip_kernel[ ( position >> ( 32 - Blip_phase_bits ) ) & ( Blip_phases - 1 ) ];
+   for( int i = 0; i < Blip_taps; ++i ) {
+      dest[i] += kernel[i] * delta;
+   }
+}
+
+static inline void output( Nes *this, int channel, long time, int level )
+{
+   Nes_Audio *audio = this->audio;
+   if( audio != NULL && level != audio->level[channel] ) {
+      add_delta( audio, time, ( level - audio->level[channel] ) * channel_weight[channel] );
+      audio->level[channel] = level;
+   }
+}
+
+// Turn the deltas up to `time` into samples and push them to the ring
+static void flush( Nes_Audio *audio, long time )
+{
+   uint64_t position = audio->offset + (uint64_t)( time - audio->start ) * audio->step;
+   int count = (int)( position >>32 );
+
+   size_t write = atomic_load_explicit( &audio->ring_write, memory_order_relaxed );
+   size_t read  = atomic_load_explicit( &audio->ring_read, memory_order_acquire );
+   size_t room  = audio->ring_mask + 1 - ( write - read );
+   for( int i = 0; i < count; ++i )
+   {
+      audio->integrator += audio->deltas[i];
+      int64_t level = (int64_t)( audio->integrator >> Blip_bits ) * 65536;
+      int64_t sample = ( level - audio->highpass ) >>16;
+      audio->highpass += ( level - audio->highpass ) >>10;
+      if( sample > 32767 ) sample = 32767;
+      if( sample < -32768 ) sample = -32768;
+      if( room > 0 ) {
+         audio->ring[ write & audio->ring_mask ] = (short) sample;
+         write++;
+         room--;
+      }
+      else {
+         atomic_fetch_add_explicit( &audio->dropped, 1, memory_order_relaxed );
+      }
+   }
+   atomic_store_explicit( &audio->ring_write, write, memory_order_release );
+
+   memmove( audio->deltas, &audio->deltas[count], Blip_taps * sizeof( int32_t ) );
+   memset( &audio->deltas[Blip_taps], 0, count * sizeof( int32_t ) );
+   audio->offset = position - ( (uint64_t) count <<32 );
+   audio->start = time;
+}
+
+// -------------------------------------------------------------------------------
+static void clock_envelope( Apu_Envelope *envelope, byte period, byte loop )
+{
+   if( envelope->start ) {
+      envelope->start = 0;
+      envelope->decay = 15;
+      envelope->divider = period;
+   }
+   else if( envelope->divider == 0 ) {
+      envelope->divider = period;
+      if( envelope->decay > 0 ) {
+         envelope->decay--;
+      }
+      else if( loop ) {
+         envelope->decay = 15;
+      }
+   }
+   else {
+      envelope->divider--;
+   }
+}
+
+static int sweep_target( Apu_Pulse *pulse, int channel )
+{
+   int change = pulse->timer >> pulse->sweep_shift;
+   if( pulse->sweep_negate ) {
+      return pulse->timer - change - ( channel == Pulse1 ); // Pulse 1 negates in ones' complement
+   }
+   return pulse->timer + change;
+}
+
+static int pulse_volume( Apu_Pulse *pulse, int channel )
+{
+   if( pulse->length == 0 || pulse->timer < 8 || sweep_target( pulse, channel ) > 0x7FF ) {
+      return 0;
+   }
+   return pulse->constant_volume ? pulse->volume : pulse->envelope.decay;
+}
+
+static int noise_level( Apu_Noise *noise )
+{
+   if( noise->length == 0 || ( noise->lfsr & 1 ) ) {
+      return 0;
+   }
+   return noise->constant_volume ? noise->volume : noise->envelope.decay;
+}
+
+static int triangle_level( Apu_Triangle *triangle )
+{
+   return ( triangle->step < 16 ) ? 15 - triangle->step : triangle->step - 16;
+}
+
+// Levels change outside of the timers too: envelopes, length counters, register writes
+static void update_levels( Nes *this, long time )
+{
+   for( int channel = Pulse1; channel <= Pulse2; ++channel ) {
+      Apu_Pulse *pulse = &this->apu.pulse[channel];
+      output( this, channel, time, duty_table[ pulse->duty ][ pulse->step ] * pulse_volume( pulse, channel ) );
+   }
+   output( this, Triangle, time, triangle_level( &this->apu.triangle ) );
+   output( this, Noise, time, noise_level( &this->apu.noise ) );
+   output( this, Dmc, time, this->apu.dmc.level );
+}
+
+// -------------------------------------------------------------------------------
+// Channel timers up to `end`
+
+static void run_pulse( Nes *this, int channel, long end )
+{
+   Apu_Pulse *pulse = &this->apu.pulse[channel];
+   long period = ( pulse->timer + 1 ) * 2;
+   int volume = pulse_volume( pulse, channel );
+   if( volume == 0 ) { // Silent, just keep the sequencer position
+      if( pulse->next < end ) {
+         long clocks = ( end - pulse->next + period - 1 ) / period;
+         pulse->step = ( pulse->step + clocks ) & 7;
+         pulse->next += clocks * period;
+      }
+      return;
+   }
+   for( ; pulse->next < end; pulse->next += period ) {
+      pulse->step = ( pulse->step + 1 ) & 7;
+      output( this, channel, pulse->next, duty_table[ pulse->duty ][ pulse->step ] * volume );
+   }
+}
+
+static void run_triangle( Nes *this, long end )
+{
+   Apu_Triangle *triangle = &this->apu.triangle;
+   long period = triangle->timer + 1;
+   // The sequencer stops without length or linear counter. Ultrasonic periods are stopped too, instead of
+   // playing a tone nobody hears and popping.
+   if( triangle->length == 0 || triangle->linear == 0 || triangle->timer < 2 ) {
+      if( triangle->next < end ) {
+         triangle->next += ( end - triangle->next + period - 1 ) / period * period;
+      }
+      return;
+   }
+   for( ; triangle->next < end; triangle->next += period ) {
+      triangle->step = ( triangle->step + 1 ) & 31;
+      output( this, Triangle, triangle->next, triangle_level( triangle ) );
+   }
+}
+
+static void run_noise( Nes *this, long end )
+{
+   Apu_Noise *noise = &this->apu.noise;
+   long period = noise_periods[ noise->period ];
+   int tap = noise->mode ? 6 : 1;
+   for( ; noise->next < end; noise->next += period ) {
+      word feedback = ( noise->lfsr ^ ( noise->lfsr >> tap ) ) & 1;
+      noise->lfsr = ( noise->lfsr >>1 ) | ( feedback <<14 );
+      output( this, Noise, noise->next, noise_level( noise ) );
+   }
+}
+
+static void dmc_fetch( Nes *this )
+{
+   Apu_Dmc *dmc = &this->apu.dmc;
+   if( dmc->buffer_full || dmc->remaining == 0 ) {
+      return;
+   }
+   dmc->buffer = Nes_ReadMemory( this, dmc->address ); // WIP the CPU should be stalled up to 4 cycles
+   dmc->buffer_full = 1;
+   dmc->address = ( dmc->address == 0xFFFF ) ? 0x8000 : dmc->address + 1;
+   dmc->remaining--;
+   if( dmc->remaining == 0 ) {
+      if( dmc->loop ) {
+         dmc->address = dmc->sample_address;
+         dmc->remaining = dmc->sample_length;
+      }
+      else if( dmc->irq_enabled ) {
+         dmc->irq = 1; // WIP Cpu6502 has no IRQ input yet
+      }
+   }
+}
+
+static void run_dmc( Nes *this, long end )
+{
+   Apu_Dmc *dmc = &this->apu.dmc;
+   long period = dmc_periods[ dmc->rate ];
+   for( ; dmc->next < end; dmc->next += period )
+   {
+      if( ! dmc->silence ) {
+         if( dmc->shift & 1 ) {
+            if( dmc->level <= 125 ) dmc->level += 2;
+         }
+         else {
+            if( dmc->level >= 2 ) dmc->level -= 2;
+         }
+         output( this, Dmc, dmc->next, dmc->level );
+      }
+      dmc->shift >>= 1;
+      if( --dmc->bits == 0 ) {
+         dmc->bits = 8;
+         dmc->silence = ! dmc->buffer_full;
+         dmc->shift = dmc->buffer;
+         dmc->buffer_full = 0;
+         dmc_fetch( this );
+      }
+   }
+}
+
+// -------------------------------------------------------------------------------
+static void quarter_frame( Nes *this )
+{
+   for( int channel = Pulse1; channel <= Pulse2; ++channel ) {
+      Apu_Pulse *pulse = &this->apu.pulse[channel];
+      clock_envelope( &pulse->envelope, pulse->volume, pulse->halt );
+   }
+   clock_envelope( &this->apu.noise.envelope, this->apu.noise.volume, this->apu.noise.halt );
+
+   Apu_Triangle *triangle = &this->apu.triangle;
+   if( triangle->linear_reload ) {
+      triangle->linear = triangle->linear_reload_value;
+   }
+   else if( triangle->linear > 0 ) {
+      triangle->linear--;
+   }
+   if( ! triangle->control ) {
+      triangle->linear_reload = 0;
+   }
+}
+
+static void half_frame( Nes *this )
+{
+   for( int channel = Pulse1; channel <= Pulse2; ++channel )
+   {
+      Apu_Pulse *pulse = &this->apu.pulse[channel];
+      if( ! pulse->halt && pulse->length > 0 ) {
+         pulse->length--;
+      }
+      int target = sweep_target( pulse, channel );
+      if( pulse->sweep_divider == 0 && pulse->sweep_enabled && pulse->sweep_shift > 0
+         && pulse->timer >= 8 && target <= 0x7FF )
+      {
+         pulse->timer = target;
+      }
+      if( pulse->sweep_divider == 0 || pulse->sweep_reload ) {
+         pulse->sweep_divider = pulse->sweep_period;
+         pulse->sweep_reload = 0;
+      }
+      else {
+         pulse->sweep_divider--;
+      }
+   }
+   if( ! this->apu.triangle.control && this->apu.triangle.length > 0 ) {
+      this->apu.triangle.length--;
+   }
+   if( ! this->apu.noise.halt && this->apu.noise.length > 0 ) {
+      this->apu.noise.length--;
+   }
+}
+
+static void run_channels( Nes *this, long end )
+{
+   run_pulse( this, Pulse1, end );
+   run_pulse( this, Pulse2, end );
+   run_triangle( this, end );
+   run_noise( this, end );
+   run_dmc( this, end );
+}
+
+// Run the APU from apu.time up to `end`, stopping at each frame counter event on the way
+static void run_apu( Nes *this, long end )
+{
+   while( this->apu.time < end )
+   {
+      long event = this->apu.sequence_start + sequence_events[ this->apu.sequence_mode ][ this->apu.sequence_step ];
+      if( event > end ) {
+         run_channels( this, end );
+         this->apu.time = end;
+         break;
+      }
+      run_channels( this, event );
+      this->apu.time = event;
+
+      int step = this->apu.sequence_step;
+      quarter_frame( this );
+      if( step == 1 || step == 3 ) {
+         half_frame( this );
+      }
+      if( step == 3 ) {
+         if( this->apu.sequence_mode == 0 && ! this->apu.irq_inhibit ) {
+            this->apu.frame_irq = 1; // WIP Cpu6502 has no IRQ input yet
+         }
+         this->apu.sequence_start += sequence_length[ this->apu.sequence_mode ];
+         this->apu.sequence_step = 0;
+      }
+      else {
+         this->apu.sequence_step++;
+      }
+      update_levels( this, event );
+   }
+}
+
+// -------------------------------------------------------------------------------
+void Nes_SyncApu( Nes *this )
+{
+   Nes_Audio *audio = this->audio;
+   if( audio != NULL && ( this->apu.time < audio->start || this->apu.time - audio->start > Sync_chunk ) ) {
+      audio->start = this->apu.time; // The clock jumped, after a reset or a state load
+   }
+   while( this->apu.time < this->cpu_cycles )
+   {
+      long end = this->apu.time + Sync_chunk;
+      if( end > this->cpu_cycles ) {
+         end = this->cpu_cycles;
+      }
+      run_apu( this, end );
+      if( audio != NULL ) {
+         flush( audio, end );
+      }
+   }
+}
+
+void Apu_Reset( Nes *this )
+{
+   memset( &this->apu, 0, sizeof this->apu );
+   this->apu.noise.lfsr = 1;
+   this->apu.dmc.bits = 8;
+   this->apu.dmc.silence = 1;
+   this->apu.time = this->cpu_cycles;
+   this->apu.sequence_start = this->cpu_cycles;
+   this->apu.pulse[0].next = this->apu.pulse[1].next = this->cpu_cycles;
+   this->apu.triangle.next = this->apu.noise.next = this->apu.dmc.next = this->cpu_cycles;
+}
+
+// -------------------------------------------------------------------------------
+// $4000..$4013, $4015, $4017
+void write_apu( void *sys, word address, byte value )
+{
+   profile_write( NES, address );
+   Nes_SyncApu( NES );
+   Apu_Pulse *pulse = &NES->apu.pulse[ ( address >>2 ) & 1 ];
+   switch( address )
+   {
+      case 0x4000: case 0x4004:
+         pulse->duty = value >>6;
+         pulse->halt = ( value >>5 ) & 1;
+         pulse->constant_volume = ( value >>4 ) & 1;
+         pulse->volume = value & 0x0F;
+         break;
+      case 0x4001: case 0x4005:
+         pulse->sweep_enabled = value >>7;
+         pulse->sweep_period = ( value >>4 ) & 7;
+         pulse->sweep_negate = ( value >>3 ) & 1;
+         pulse->sweep_shift = value & 7;
+         pulse->sweep_reload = 1;
+         break;
+      case 0x4002: case 0x4006:
+         pulse->timer = ( pulse->timer & 0x700 ) | value;
+         break;
+      case 0x4003: case 0x4007:
+         pulse->timer = ( pulse->timer & 0xFF ) | ( ( value & 7 ) <<8 );
+         if( NES->apu.enabled & ( 1 << ( ( address >>2 ) & 1 ) ) ) {
+            pulse->length = length_table[ value >>3 ];
+         }
+         pulse->step = 0;
+         pulse->envelope.start = 1;
+         break;
+
+      case 0x4008:
+         NES->apu.triangle.control = value >>7;
+         NES->apu.triangle.linear_reload_value = value & 0x7F;
+         break;
+      case 0x400A:
+         NES->apu.triangle.timer = ( NES->apu.triangle.timer & 0x700 ) | value;
+         break;
+      case 0x400B:
+         NES->apu.triangle.timer = ( NES->apu.triangle.timer & 0xFF ) | ( ( value & 7 ) <<8 );
+         if( NES->apu.enabled & 4 ) {
+            NES->apu.triangle.length = length_table[ value >>3 ];
+         }
+         NES->apu.triangle.linear_reload = 1;
+         break;
+
+      case 0x400C:
+         NES->apu.noise.halt = ( value >>5 ) & 1;
+         NES->apu.noise.constant_volume = ( value >>4 ) & 1;
+         NES->apu.noise.volume = value & 0x0F;
+         break;
+      case 0x400E:
+         NES->apu.noise.mode = value >>7;
+         NES->apu.noise.period = value & 0x0F;
+         break;
+      case 0x400F:
+         if( NES->apu.enabled & 8 ) {
+            NES->apu.noise.length = length_table[ value >>3 ];
+         }
+         NES->apu.noise.envelope.start = 1;
+         break;
+
+      case 0x4010:
+         NES->apu.dmc.irq_enabled = value >>7;
+         NES->apu.dmc.loop = ( value >>6 ) & 1;
+         NES->apu.dmc.rate = value & 0x0F;
+         if( ! NES->apu.dmc.irq_enabled ) {
+            NES->apu.dmc.irq = 0;
+         }
+         break;
+      case 0x4011:
+         NES->apu.dmc.level = value & 0x7F;
+         break;
+      case 0x4012:
+         NES->apu.dmc.sample_address = 0xC000 + value * 64;
+         break;
+      case 0x4013:
+         NES->apu.dmc.sample_length = value * 16 + 1;
+         break;
+
+      case 0x4015:
+         NES->apu.enabled = value & 0x1F;
+         if( !( value & 1 ) ) NES->apu.pulse[0].length = 0;
+         if( !( value & 2 ) ) NES->apu.pulse[1].length = 0;
+         if( !( value & 4 ) ) NES->apu.triangle.length = 0;
+         if( !( value & 8 ) ) NES->apu.noise.length = 0;
+         NES->apu.dmc.irq = 0;
+         if( !( value & 0x10 ) ) {
+            NES->apu.dmc.remaining = 0;
+         }
+         else if( NES->apu.dmc.remaining == 0 ) {
+            NES->apu.dmc.address = NES->apu.dmc.sample_address;
+            NES->apu.dmc.remaining = NES->apu.dmc.sample_length;
+            dmc_fetch( NES );
+         }
+         break;
+
+      case 0x4017:
+         NES->apu.sequence_mode = value >>7;
+         NES->apu.irq_inhibit = ( value >>6 ) & 1;
+         if( NES->apu.irq_inhibit ) {
+            NES->apu.frame_irq = 0;
+         }
+         NES->apu.sequence_start = NES->cpu_cycles + 3;
+         NES->apu.sequence_step = 0;
+         if( NES->apu.sequence_mode ) {
+            quarter_frame( NES );
+            half_frame( NES );
+         }
+         break;
+   }
+   update_levels( NES, NES->apu.time );
+}
+
+// $4015
+byte read_apu_status( void *sys, word address )
+{
+   profile_read( NES, address );
+   Nes_SyncApu( NES );
+   byte value =
+      ( NES->apu.pulse[0].length > 0 ) |
+      ( NES->apu.pulse[1].length > 0 ) <<1 |
+      ( NES->apu.triangle.length > 0 ) <<2 |
+      ( NES->apu.noise.length > 0 ) <<3 |
+      ( NES->apu.dmc.remaining > 0 ) <<4 |
+      NES->apu.frame_irq <<6 |
+      NES->apu.dmc.irq <<7;
+   NES->apu.frame_irq = 0;
+
+   #ifdef _Cpu6502_Disassembler
+      NES->cpu->disasm.value = value;
+   #endif
+
+   return value;
+}
+
+// -------------------------------------------------------------------------------
+// Start producing samples at `rate` Hz into a ring of at least `ring_samples`. Returns false if out of memory.
+int Nes_AudioEnable( Nes *this, int rate, size_t ring_samples )
+{
+   Nes_AudioDisable( this );
+   pthread_once( &blip_once, init_blip_kernel );
+
+   Nes_Audio *audio = (Nes_Audio*) calloc( 1, sizeof( Nes_Audio ) );
+   if( audio == NULL ) {
+      return false;
+   }
+   size_t ring_size = 1;
+   while( ring_size < ring_samples ) {
+      ring_size <<= 1;
+   }
+   audio->rate = rate;
+   audio->step = (uint64_t)( (double) rate / Cpu_clock * 4294967296.0 );
+   audio->capacity = (int)( (uint64_t) Sync_chunk * audio->step >>32 ) + 2;
+   audio->deltas = (int32_t*) calloc( audio->capacity + Blip_taps, sizeof( int32_t ) );
+   audio->ring = (short*) malloc( ring_size * sizeof( short ) );
+   audio->ring_mask = ring_size - 1;
+   if( audio->deltas == NULL || audio->ring == NULL ) {
+      free( audio->deltas );
+      free( audio->ring );
+      free( audio );
+      return false;
+   }
+   audio->start = this->apu.time;
+   this->audio = audio;
+   update_levels( this, this->apu.time );
+   return true;
+}
+
+void Nes_AudioDisable( Nes *this )
+{
+   if( this->audio == NULL ) {
+      return;
+   }
+   free( this->audio->deltas );
+   free( this->audio->ring );
+   free( this->audio );
+   this->audio = NULL;
+}
+
+// -------------------------------------------------------------------------------
+// Take up to `count` samples out of the ring. Safe to call from one other thread while the emulation runs.
+size_t Nes_AudioRead( Nes *this, short *dest, size_t count )
+{
+   Nes_Audio *audio = this->audio;
+   if( audio == NULL ) {
+      return 0;
+   }
+   size_t read  = atomic_load_explicit( &audio->ring_read, memory_order_relaxed );
+   size_t write = atomic_load_explicit( &audio->ring_write, memory_order_acquire );
+   if( count > write - read ) {
+      count = write - read;
+   }
+   for( size_t i = 0; i < count; ++i ) {
+      dest[i] = audio->ring[ ( read + i ) & audio->ring_mask ];
+   }
+   atomic_store_explicit( &audio->ring_read, read + count, memory_order_release );
+   return count;
+}
+
+// Samples dropped because the ring was full
+unsigned long Nes_AudioDropped( Nes *this )
+{
+   return ( this->audio != NULL ) ? atomic_load( &this->audio->dropped ) : 0;
+}
@@ -0,0 +1,78 @@
+#ifndef _Apu_h_
+   #define _Apu_h_
+
+#include "Cpu6502.h"
+
+// APU channel state, part of the Nes state block so it holds no pointers. Times are absolute CPU cycles.
+
+typedef struct
+{
+   byte start;   // Restart on the next quarter frame
+   byte divider;
+   byte decay;   // Volume when not constant [0..15]
+} Apu_Envelope;
+
+typedef struct
+{
+   byte duty;    // $4000 / $4004
+   byte halt;    // Length counter halt, also envelope loop
+   byte constant_volume;
+   byte volume;  // Constant volume or envelope period
+   Apu_Envelope envelope;
+   byte sweep_enabled; // $4001 / $4005
+   byte sweep_period;
+   byte sweep_negate;
+   byte sweep_shift;
+   byte sweep_divider;
+   byte sweep_reload;
+   word timer;   // $4002..$4003 / $4006..$4007, 11 bits
+   byte length;
+   byte step;    // Duty sequencer [0..7]
+   long next;    // Next timer clock
+} Apu_Pulse;
+
+typedef struct
+{
+   byte control; // $4008, also length counter halt
+   byte linear_reload_value;
+   byte linear_reload;
+   byte linear;
+   word timer;
+   byte length;
+   byte step;    // [0..31]
+   long next;
+} Apu_Triangle;
+
+typedef struct
+{
+   byte halt;    // $400C
+   byte constant_volume;
+   byte volume;
+   Apu_Envelope envelope;
+   byte mode;    // $400E
+   byte period;
+   byte length;
+   word lfsr;
+   long next;
+} Apu_Noise;
+
+typedef struct
+{
+   byte irq_enabled; // $4010
+   byte loop;
+   byte rate;
+   byte level;   // $4011, output [0..127]
+   word sample_address; // $4012
+   word sample_length;  // $4013
+   word address; // Current sample byte
+   word remaining; // Bytes left to fetch
+   byte buffer;
+   byte buffer_full;
+   byte shift;   // Output unit
+   byte bits;
+   byte silence;
+   byte irq;
+   long next;
+} Apu_Dmc;
+
+#endif // #ifndef _Apu_h_
@@ -0,0 +1,399 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "Batch.h"
+#include "Movie.h"
+#include "Rom.h"
+
+// -------------------------------------------------------------------------------
+// Work stealing: every worker starts with an even share of the jobs as a range of indexes packed in one
+// atomic word (begin in the high 32 bits, end in the low 32 bits). The owner takes jobs from the front,
+// an idle worker steals the back half of someone else's range. Both are a single compare and swap.
+
+typedef struct
+{
+   _Atomic uint64_t range;
+   char padding[64 - sizeof( uint64_t )]; // Keep each queue on its own cache line
+} Queue;
+
+typedef struct
+{
+   Nes_BatchJob *jobs;
+   Nes_Rom **roms; // One per job, jobs with the same ROM path share it
+   Queue *queues;
+   int workers;
+} Pool;
+
+typedef struct
+{
+   Pool *pool;
+   int index;
+} Worker;
+
+#define range( begin, end ) ( ( (uint64_t)(begin) <<32 ) | (uint32_t)(end) )
+#define range_begin( r ) ( (uint32_t)( (r) >>32 ) )
+#define range_end( r )   ( (uint32_t)(r) )
+
+// Take the job at the front of a queue, -1 if empty
+static int pop_job( Queue *queue )
+{
+   uint64_t r = atomic_load( &queue->range );
+   while( range_begin( r ) < range_end( r ) )
+   {
+      if( atomic_compare_exchange_weak( &queue->range, &r, range( range_begin( r ) + 1, range_end( r ) ) ) ) {
+         return (int) range_begin( r );
+      }
+   }
+   return -1;
+}
+
+// Move the back half of another worker's queue into our own empty one, false if there was nothing left anywhere
+static int steal_jobs( Pool *pool, int thief )
+{
+   for( int i = 1; i < pool->workers; ++i )
+   {
+      Queue *victim = &pool->queues[ ( thief + i ) % pool->workers ];
+      uint64_t r = atomic_load( &victim->range );
+      while( range_begin( r ) < range_end( r ) )
+      {
+         uint32_t count = range_end( r ) - range_begin( r );
+         uint32_t split = range_end( r ) - ( count + 1 ) / 2;
+         if( atomic_compare_exchange_weak( &victim->range, &r, range( range_begin( r ), split ) ) ) {
+            atomic_store( &pool->queues[thief].range, range( split, range_end( r ) ) );
+            return true;
+         }
+      }
+   }
+   return false;
+}
+
+// -------------------------------------------------------------------------------
+static uint64_t hash_frame( const byte *framebuffer )
+{
+   uint64_t hash = 0xCBF29CE484222325ull; // FNV-1a
+   for( int i = 0; i < Nes_screen_width * Nes_screen_height; ++i ) {
+      hash = ( hash ^ framebuffer[i] ) * 0x100000001B3ull;
+   }
+   return hash;
+}
+
+static void run_job( Nes_BatchJob *job, Nes_Rom *rom )
+{
+   struct timespec start, end;
+   clock_gettime( CLOCK_MONOTONIC, &start );
+
+   job->loaded = false;
+   job->movie_mismatch = -1;
+   if( rom == NULL ) {
+      return;
+   }
+   Nes *nes = Nes_Create();
+   if( nes == NULL ) {
+      return;
+   }
+   job->loaded = Nes_AttachRom( nes, rom );
+
+   if( job->loaded )
+   {
+      Nes_Reset( nes );
+      if( job->movie != NULL ) {
+         Nes_MoviePlay( nes, job->movie );
+      }
+      for( int frame = 0; frame < job->frames; ++frame )
+      {
+         for( int gamepad = 0; gamepad <= 1 && job->movie == NULL; ++gamepad ) {
+            byte state = ( job->input != NULL && frame < job->input_frames ) ? job->input[ frame * 2 + gamepad ] : 0;
+            Nes_SetGamepad( nes, gamepad, state );
+         }
+         Nes_DoFrame( nes );
+         if( job->frame_hashes != NULL ) {
+            job->frame_hashes[frame] = hash_frame( Nes_GetFramebuffer( nes ) );
+         }
+      }
+      memcpy( job->ram, nes->ram, sizeof job->ram );
+      job->movie_mismatch = Nes_MovieMismatch( nes );
+   }
+   Nes_Free( nes );
+
+   clock_gettime( CLOCK_MONOTONIC, &end );
+   job->elapsed_ns = ( end.tv_sec - start.tv_sec ) * 1000000000L + ( end.tv_nsec - start.tv_nsec );
+}
+
+// Order jobs by ROM path, then by position so the first job of each ROM comes first
+static int compare_rom_paths( const void *a, const void *b )
+{
+   const Nes_BatchJob *x = *(const Nes_BatchJob* const*) a;
+   const Nes_BatchJob *y = *(const Nes_BatchJob* const*) b;
+   int order = strcmp( x->rom_path, y->rom_path );
+   if( order != 0 ) {
+      return order;
+   }
+   return ( x > y ) - ( x < y );
+}
+
+static void *worker_main( void *arg )
+{
+   Worker *worker = (Worker*) arg;
+   Pool *pool = worker->pool;
+   do {
+      int job;
+      while(( job = pop_job( &pool->queues[ worker->index ] )) >= 0 ) {
+         run_job( &pool->jobs[job], pool->roms[job] );
+      }
+   } while( steal_jobs( pool, worker->index ) );
+   return NULL;
+}
+
+// -------------------------------------------------------------------------------
+// Run `count` jobs over `threads` worker threads (0 for one per online core).
+// Returns false if memory for the pool couldn't be allocated.
+int Nes_RunBatch( Nes_BatchJob *jobs, int count, int threads )
+{
+   if( threads <= 0 ) {
+      threads = (int) sysconf( _SC_NPROCESSORS_ONLN );
+   }
+   if( threads > count ) {
+      threads = count;
+   }
+   if( threads <= 0 ) {
+      return true;
+   }
+
+   Pool pool;
+   pool.jobs = jobs;
+   pool.workers = threads;
+   pool.queues = (Queue*) aligned_alloc( 64, threads * sizeof( Queue ) );
+   pool.roms = (Nes_Rom**) calloc( count, sizeof( Nes_Rom* ) );
+   pthread_t *thread = (pthread_t*) malloc( threads * sizeof( pthread_t ) );
+   Worker *worker = (Worker*) malloc( threads * sizeof( Worker ) );
+   Nes_BatchJob **order = (Nes_BatchJob**) malloc( count * sizeof( Nes_BatchJob* ) );
+   if( pool.queues == NULL || pool.roms == NULL || thread == NULL || worker == NULL || order == NULL ) {
+      free( pool.queues );
+      free( pool.roms );
+      free( thread );
+      free( worker );
+      free( order );
+      return false;
+   }
+
+   // Map each distinct ROM once, its image and unpacked CHR are shared by all its jobs.
+   // Sorting by path puts the jobs of a ROM next to each other, so this is O(n log n) in the job count.
+   for( int i = 0; i < count; ++i ) {
+      order[i] = &jobs[i];
+   }
+   qsort( order, count, sizeof( Nes_BatchJob* ), compare_rom_paths );
+   for( int i = 0; i < count; ++i )
+   {
+      int job = (int)( order[i] - jobs );
+      int previous = i > 0 ? (int)( order[i - 1] - jobs ) : -1;
+      if( previous >= 0 && pool.roms[previous] != NULL && strcmp( jobs[job].rom_path, jobs[previous].rom_path ) == 0 ) {
+         pool.roms[job] = Nes_RomRetain( pool.roms[previous] );
+      }
+      else {
+         pool.roms[job] = Nes_RomOpen( jobs[job].rom_path );
+      }
+   }
+   free( order );
+
+   for( int i = 0; i < threads; ++i ) {
+      atomic_init( &pool.queues[i].range, range( (int64_t) count * i / threads, (int64_t) count * ( i + 1 ) / threads ) );
+      worker[i].pool = &pool;
+      worker[i].index = i;
+   }
+
+   int started = 0;
+   for( int i = 1; i < threads; ++i ) {
+      if( pthread_create( &thread[i], NULL, worker_main, &worker[i] ) == 0 ) {
+         started = i;
+      }
+      else {
+         break; // Whoever runs will steal the jobs of the workers that didn't start
+      }
+   }
+   worker_main( &worker[0] );
+   for( int i = 1; i <= started; ++i ) {
+      pthread_join( thread[i], NULL );
+   }
+
+   for( int i = 0; i < count; ++i ) {
+      Nes_RomRelease( pool.roms[i] );
+   }
+   free( pool.queues );
+   free( pool.roms );
+   free( thread );
+   free( worker );
+   return true;
+}
+
+// -------------------------------------------------------------------------------
+// Lockstep stepping. Each step is handed to the pool by bumping `generation`, then every thread, the
+// caller's included, takes instances off the shared `next` index until there are none left.
+
+struct Nes_StepPool
+{
+   pthread_mutex_t lock;
+   pthread_cond_t start; // generation changed or quitting
+   pthread_cond_t done;  // the last worker finished its part of the step
+   pthread_t *thread;
+   int threads;          // Worker threads, the caller is not counted
+   unsigned generation;
+   int busy;             // Workers still stepping
+   int quit;
+
+   // The step being run
+   Nes **envs;
+   const byte *actions;
+   int n;
+   int frames;
+   byte *screens;
+   byte *rams;
+   atomic_int next;
+};
+
+static void step_env( Nes_StepPool *step, int i )
+{
+   Nes *nes = step->envs[i];
+   if( step->actions != NULL ) {
+      Nes_SetGamepad( nes, 0, step->actions[ i * 2 ] );
+      Nes_SetGamepad( nes, 1, step->actions[ i * 2 + 1 ] );
+   }
+   if( step->screens != NULL ) {
+      Nes_SetFramebuffer( nes, &step->screens[ (size_t) i * Nes_screen_width * Nes_screen_height ] );
+   }
+   for( int frame = 0; frame < step->frames; ++frame ) {
+      Nes_DoFrame( nes );
+   }
+   if( step->screens != NULL ) {
+      Nes_GetFramebuffer( nes ); // Renders the lines left if rendering is skipped
+   }
+   if( step->rams != NULL ) {
+      memcpy( &step->rams[ (size_t) i * sizeof nes->ram ], nes->ram, sizeof nes->ram );
+   }
+}
+
+static void step_envs( Nes_StepPool *step )
+{
+   int i;
+   while(( i = atomic_fetch_add( &step->next, 1 )) < step->n ) {
+      step_env( step, i );
+   }
+}
+
+static void *step_worker( void *arg )
+{
+   Nes_StepPool *pool = (Nes_StepPool*) arg;
+   unsigned generation = 0;
+   pthread_mutex_lock( &pool->lock );
+   while( 1 )
+   {
+      while( pool->generation == generation && ! pool->quit ) {
+         pthread_cond_wait( &pool->start, &pool->lock );
+      }
+      if( pool->quit ) {
+         break;
+      }
+      generation = pool->generation;
+      pthread_mutex_unlock( &pool->lock );
+      step_envs( pool );
+      pthread_mutex_lock( &pool->lock );
+      if( --pool->busy == 0 ) {
+         pthread_cond_signal( &pool->done );
+      }
+   }
+   pthread_mutex_unlock( &pool->lock );
+   return NULL;
+}
+
+// -------------------------------------------------------------------------------
+// A pool stepping over `threads` threads in all (0 for one per online core), the caller's being one of them.
+// Returns NULL if out of memory.
+Nes_StepPool *Nes_StepPoolCreate( int threads )
+{
+   if( threads <= 0 ) {
+      threads = (int) sysconf( _SC_NPROCESSORS_ONLN );
+   }
+   Nes_StepPool *pool = (Nes_StepPool*) calloc( 1, sizeof( Nes_StepPool ) );
+   if( pool == NULL ) {
+      return NULL;
+   }
+   pool->thread = (pthread_t*) malloc( threads * sizeof( pthread_t ) );
+   if( pool->thread == NULL ) {
+      free( pool );
+      return NULL;
+   }
+   pthread_mutex_init( &pool->lock, NULL );
+   pthread_cond_init( &pool->start, NULL );
+   pthread_cond_init( &pool->done, NULL );
+   atomic_init( &pool->next, 0 );
+
+   for( int i = 0; i < threads - 1; ++i ) {
+      if( pthread_create( &pool->thread[i], NULL, step_worker, pool ) != 0 ) {
+         break; // Step with the threads there are
+      }
+      pool->threads++;
+   }
+   return pool;
+}
+
+void Nes_StepPoolFree( Nes_StepPool *pool )
+{
+   if( pool == NULL ) {
+      return;
+   }
+   pthread_mutex_lock( &pool->lock );
+   pool->quit = true;
+   pthread_cond_broadcast( &pool->start );
+   pthread_mutex_unlock( &pool->lock );
+   for( int i = 0; i < pool->threads; ++i ) {
+      pthread_join( pool->thread[i], NULL );
+   }
+   pthread_mutex_destroy( &pool->lock );
+   pthread_cond_destroy( &pool->start );
+   pthread_cond_destroy( &pool->done );
+   free( pool->thread );
+   free( pool );
+}
+
+// -------------------------------------------------------------------------------
+// Run `frames` frames on each of the `n` instances, holding the gamepads of instance i at actions[ i * 2 ]
+// and actions[ i * 2 + 1 ] (see Nes_SetGamepad(), NULL leaves them as they are). Then the observations:
+// - screens: n frames of Nes_screen_width * Nes_screen_height palette indexes, NULL for none. The
+//   instances render straight into it and keep doing so after the call, see Nes_SetFramebuffer().
+// - rams: n copies of the 2kB of RAM, NULL for none.
+// With a pool the instances are stepped in parallel, NULL steps them one after the other on this thread.
+void Nes_StepBatch( Nes **envs, const byte *actions, int n, int frames, byte *screens, byte *rams, Nes_StepPool *pool )
+{
+   Nes_StepPool local;
+   Nes_StepPool *step = ( pool != NULL ) ? pool : &local;
+   step->envs = envs;
+   step->actions = actions;
+   step->n = n;
+   step->frames = frames;
+   step->screens = screens;
+   step->rams = rams;
+   atomic_init( &step->next, 0 );
+
+   if( pool == NULL || pool->threads == 0 || n <= 1 ) {
+      step_envs( step );
+      return;
+   }
+   pthread_mutex_lock( &pool->lock );
+   pool->busy = pool->threads;
+   pool->generation++;
+   pthread_cond_broadcast( &pool->start );
+   pthread_mutex_unlock( &pool->lock );
+
+   step_envs( pool );
+
+   pthread_mutex_lock( &pool->lock );
+   while( pool->busy > 0 ) {
+      pthread_cond_wait( &pool->done, &pool->lock );
+   }
+   pthread_mutex_unlock( &pool->lock );
+}
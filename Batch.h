@@ -0,0 +1,36 @@
+#ifndef _Batch_h_
+   #define _Batch_h_
+
+#include <stdint.h>
+#include "Nes.h"
+
+// One headless run: load a ROM, feed it input for a number of frames, collect the results.
+// Each job owns its results, workers never share an emulator nor lock while running one.
+typedef struct
+{
+   // Filled by the caller
+   const char *rom_path;
+   const byte *input;     // Packed gamepad state per frame, input[ frame * 2 + gamepad ], see Nes_SetGamepad(). May be NULL.
+   int input_frames;      // Frames in `input`, gamepads are released after them
+   const struct Nes_Movie *movie; // Played instead of `input` if not NULL, may be shared by several jobs
+   int frames;            // Frames to run
+   uint64_t *frame_hashes; // Optional, receives a hash of the framebuffer of each of the `frames`
+
+   // Filled by the runner
+   int loaded;            // false if the ROM couldn't be loaded, nothing else is filled then
+   byte ram[0x800];       // RAM after the last frame
+   long elapsed_ns;       // Wall time of the run, from attaching the ROM to the last frame
+   int movie_mismatch;    // First frame whose RAM didn't match the movie's hash, -1 if none
+} Nes_BatchJob;
+
+int Nes_RunBatch( Nes_BatchJob *jobs, int count, int threads );
+
+// Stepping many instances in lockstep, e.g. as a vectorized environment. The threads of a pool wait
+// between steps, so a step costs no thread creation.
+typedef struct Nes_StepPool Nes_StepPool;
+
+Nes_StepPool *Nes_StepPoolCreate( int threads );
+void Nes_StepPoolFree( Nes_StepPool *pool );
+void Nes_StepBatch( Nes **envs, const byte *actions, int n, int frames, byte *screens, byte *rams, Nes_StepPool *pool );
+
+#endif // #ifndef _Batch_h_
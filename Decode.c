@@ -0,0 +1,106 @@
+#include "Nes.h"
+#include "Decode.h"
+
+// -------------------------------------------------------------------------------
+// 6502 instruction decoding, on the fly from the memory backed pages. Used to recognize idle loops, see
+// skip_idle_loop(), where a few instructions are decoded once per loop found.
+
+#define imp Decode_implied
+#define acc Decode_accumulator
+#define imm Decode_immediate
+#define zp  Decode_zero_page
+#define zpx Decode_zero_page_x
+#define zpy Decode_zero_page_y
+#define abs Decode_absolute
+#define abx Decode_absolute_x
+#define aby Decode_absolute_y
+#define ind Decode_indirect
+#define izx Decode_indirect_x
+#define izy Decode_indirect_y
+#define rel Decode_relative
+
+// Addressing mode of each opcode, unofficial ones included. The jams (x2) are taken as implied.
+static const byte modes[0x100] = {
+//   0    1    2    3    4    5    6    7    8    9    A    B    C    D    E    F
+   imp, izx, imp, izx, zp,  zp,  zp,  zp,  imp, imm, acc, imm, abs, abs, abs, abs, // 0
+   rel, izy, imp, izy, zpx, zpx, zpx, zpx, imp, aby, imp, aby, abx, abx, abx, abx, // 1
+   abs, izx, imp, izx, zp,  zp,  zp,  zp,  imp, imm, acc, imm, abs, abs, abs, abs, // 2
+   rel, izy, imp, izy, zpx, zpx, zpx, zpx, imp, aby, imp, aby, abx, abx, abx, abx, // 3
+   imp, izx, imp, izx, zp,  zp,  zp,  zp,  imp, imm, acc, imm, abs, abs, abs, abs, // 4
+   rel, izy, imp, izy, zpx, zpx, zpx, zpx, imp, aby, imp, aby, abx, abx, abx, abx, // 5
+   imp, izx, imp, izx, zp,  zp,  zp,  zp,  imp, imm, acc, imm, ind, abs, abs, abs, // 6
+   rel, izy, imp, izy, zpx, zpx, zpx, zpx, imp, aby, imp, aby, abx, abx, abx, abx, // 7
+   imm, izx, imm, izx, zp,  zp,  zp,  zp,  imp, imm, imp, imm, abs, abs, abs, abs, // 8
+   rel, izy, imp, izy, zpx, zpx, zpy, zpy, imp, aby, imp, aby, abx, abx, aby, aby, // 9
+   imm, izx, imm, izx, zp,  zp,  zp,  zp,  imp, imm, imp, imm, abs, abs, abs, abs, // A
+   rel, izy, imp, izy, zpx, zpx, zpy, zpy, imp, aby, imp, aby, abx, abx, aby, aby, // B
+   imm, izx, imm, izx, zp,  zp,  zp,  zp,  imp, imm, imp, imm, abs, abs, abs, abs, // C
+   rel, izy, imp, izy, zpx, zpx, zpx, zpx, imp, aby, imp, aby, abx, abx, abx, abx, // D
+   imm, izx, imm, izx, zp,  zp,  zp,  zp,  imp, imm, imp, imm, abs, abs, abs, abs, // E
+   rel, izy, imp, izy, zpx, zpx, zpx, zpx, imp, aby, imp, aby, abx, abx, abx, abx  // F
+};
+
+#undef imp
+#undef acc
+#undef imm
+#undef zp
+#undef zpx
+#undef zpy
+#undef abs
+#undef abx
+#undef aby
+#undef ind
+#undef izx
+#undef izy
+#undef rel
+
+static const byte lengths[] = { // By mode
+   1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 2, 2, 2
+};
+
+static const byte cycles[0x100] = {
+// 0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
+   7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6, // 0
+   2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 1
+   6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6, // 2
+   2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 3
+   6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6, // 4
+   2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 5
+   6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6, // 6
+   2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // 7
+   2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4, // 8
+   2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5, // 9
+   2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4, // A
+   2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, // B
+   2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, // C
+   2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7, // D
+   2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6, // E
+   2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7  // F
+};
+
+// -------------------------------------------------------------------------------
+// Decode the instruction at `pc`. Only memory backed pages are read, I/O never is: returns false if
+// one of its bytes isn't memory backed.
+int Decode_Instruction( Nes *this, word pc, Nes_Instruction *instruction )
+{
+   byte bytes[3];
+   const byte *page = this->read_page[ pc >>8 ];
+   if( page == NULL ) {
+      return false;
+   }
+   bytes[0] = page[ pc & 0xFF ];
+   int length = lengths[ modes[ bytes[0] ] ];
+   for( int i = 1; i < length; ++i ) {
+      word address = pc + i; // May be on the next page, mapping anything
+      if(( page = this->read_page[ address >>8 ] ) == NULL ) {
+         return false;
+      }
+      bytes[i] = page[ address & 0xFF ];
+   }
+   instruction->opcode = bytes[0];
+   instruction->mode = modes[ bytes[0] ];
+   instruction->length = length;
+   instruction->cycles = cycles[ bytes[0] ];
+   instruction->operand = ( length == 1 ) ? 0 : ( length == 2 ) ? bytes[1] : bytes[1] | ( bytes[2] <<8 );
+   return true;
+}
@@ -0,0 +1,34 @@
+#ifndef _Decode_h_
+   #define _Decode_h_
+
+#include "Nes.h"
+
+// A 6502 instruction as decoded by Decode_Instruction(), see Decode.c
+typedef struct
+{
+   byte opcode;
+   byte mode;    // Decode_implied..Decode_relative
+   byte length;  // 1..3 bytes
+   byte cycles;  // Without the page crossing and taken branch penalties
+   word operand; // Little endian operand bytes, 0 if none
+} Nes_Instruction;
+
+enum Decode_Mode {
+   Decode_implied = 0,
+   Decode_accumulator,
+   Decode_immediate,
+   Decode_zero_page,
+   Decode_zero_page_x,
+   Decode_zero_page_y,
+   Decode_absolute,
+   Decode_absolute_x,
+   Decode_absolute_y,
+   Decode_indirect,
+   Decode_indirect_x,
+   Decode_indirect_y,
+   Decode_relative
+};
+
+int Decode_Instruction( Nes *this, word pc, Nes_Instruction *instruction );
+
+#endif // #ifndef _Decode_h_
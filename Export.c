@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "Nes.h"
+#include "Export.h"
+#include "RenderThread.h"
+
+// Frames are exported by a writer thread so the emulation thread never waits on a disk or a pipe. At the
+// end of each frame Nes_DoFrame() publishes it into a free buffer of a small ring: the palette indexes of
+// the framebuffer, the 32 colors they resolve to and the frame's audio, a 61kB copy. The writer turns the
+// oldest buffer into RGB or YUV and writes it out. When every buffer is still waiting to be written the
+// policy decides: block until the writer frees one, or drop the frame. A dropped frame's audio stays in
+// the audio ring and goes out with the next published frame.
+
+#define Export_max_buffers 4
+#define Export_samples     8192 // Audio samples a buffer holds, a frame has rate / 60
+#define Frame_pixels       ( Nes_screen_width * Nes_screen_height )
+
+typedef struct
+{
+   byte pixels[Frame_pixels];
+   byte palette[3][0x20];   // RGB of each palette index, as resolved at the end of the frame the pixels are of
+   short samples[Export_samples];
+   size_t sample_count;
+} Buffer;
+
+struct Nes_Export
+{
+   FILE *video;
+   FILE *audio;           // NULL for no audio
+   int format;
+   int policy;
+
+   pthread_mutex_t lock;
+   pthread_cond_t ready;  // a buffer was published or stopping
+   pthread_cond_t freed;  // the writer is done with a buffer
+   pthread_t writer;
+   Buffer *buffers;
+   int buffer_count;
+   int first;             // Oldest published buffer
+   int count;             // Published buffers not written yet
+   int quit;
+
+   byte *packed;          // Writer scratch, a frame of RGB or YUV planes
+   int failed;            // A write failed, the following frames are discarded
+   unsigned long dropped;
+};
+
+// -------------------------------------------------------------------------------
+// BT.601 limited range, on the 32 colors of a frame rather than on each pixel
+static void palette_yuv( const Buffer *buffer, byte yuv[3][0x20] )
+{
+   for( int i = 0; i < 0x20; ++i )
+   {
+      int r = buffer->palette[0][i], g = buffer->palette[1][i], b = buffer->palette[2][i];
+      yuv[0][i] = (byte)( ( (  66 * r + 129 * g +  25 * b + 128 ) >>8 ) + 16 );
+      yuv[1][i] = (byte)( ( ( -38 * r -  74 * g + 112 * b + 128 ) >>8 ) + 128 );
+      yuv[2][i] = (byte)( ( ( 112 * r -  94 * g -  18 * b + 128 ) >>8 ) + 128 );
+   }
+}
+
+static int write_buffer( struct Nes_Export *ex, const Buffer *buffer )
+{
+   byte *out = ex->packed;
+   if( ex->format == Export_y4m )
+   {
+      byte yuv[3][0x20];
+      palette_yuv( buffer, yuv );
+      for( int plane = 0; plane < 3; ++plane ) {
+         for( int i = 0; i < Frame_pixels; ++i ) {
+            *out++ = yuv[plane][ buffer->pixels[i] & 0x1F ];
+         }
+      }
+      if( fputs( "FRAME\n", ex->video ) == EOF ) {
+         return false;
+      }
+   }
+   else {
+      for( int i = 0; i < Frame_pixels; ++i, out += 3 ) {
+         byte index = buffer->pixels[i] & 0x1F;
+         out[0] = buffer->palette[0][index];
+         out[1] = buffer->palette[1][index];
+         out[2] = buffer->palette[2][index];
+      }
+   }
+   if( fwrite( ex->packed, 3 * Frame_pixels, 1, ex->video ) != 1 ) {
+      return false;
+   }
+   if( ex->audio != NULL && buffer->sample_count > 0 &&
+       fwrite( buffer->samples, sizeof( short ), buffer->sample_count, ex->audio ) != buffer->sample_count ) {
+      return false;
+   }
+   return true;
+}
+
+static void *writer_main( void *arg )
+{
+   struct Nes_Export *ex = (struct Nes_Export*) arg;
+   if( ex->format == Export_y4m ) {
+      ex->failed = fputs( "YUV4MPEG2 W256 H240 F39375000:655171 Ip A8:7 C444\n", ex->video ) == EOF;
+   }
+   pthread_mutex_lock( &ex->lock );
+   while( 1 )
+   {
+      while( ex->count == 0 && ! ex->quit ) {
+         pthread_cond_wait( &ex->ready, &ex->lock );
+      }
+      if( ex->count == 0 ) { // Quitting with every frame written
+         break;
+      }
+      Buffer *buffer = &ex->buffers[ ex->first ];
+      pthread_mutex_unlock( &ex->lock );
+      if( ! ex->failed && ! write_buffer( ex, buffer ) ) {
+         ex->failed = true;
+         fprintf( stderr, "Frame export: write failed, the following frames are discarded\n" );
+      }
+      pthread_mutex_lock( &ex->lock );
+      ex->first = ( ex->first + 1 ) % ex->buffer_count;
+      ex->count--;
+      pthread_cond_signal( &ex->freed );
+   }
+   pthread_mutex_unlock( &ex->lock );
+   return NULL;
+}
+
+// -------------------------------------------------------------------------------
+// Called by Nes_DoFrame() when exporting
+void Export_Frame( Nes *this )
+{
+   struct Nes_Export *ex = this->export;
+   pthread_mutex_lock( &ex->lock );
+   if( ex->count == ex->buffer_count )
+   {
+      if( ex->policy == Export_drop ) {
+         ex->dropped++;
+         pthread_mutex_unlock( &ex->lock );
+         return;
+      }
+      while( ex->count == ex->buffer_count ) {
+         pthread_cond_wait( &ex->freed, &ex->lock );
+      }
+   }
+   // The writer doesn't touch buffers past the published ones, this one is filled without the lock
+   Buffer *buffer = &ex->buffers[ ( ex->first + ex->count ) % ex->buffer_count ];
+   pthread_mutex_unlock( &ex->lock );
+
+   memcpy( buffer->pixels, Nes_GetFramebuffer( this ), Frame_pixels );
+   if( this->render_thread != NULL ) { // The pixels are of the frame before, take its colors too
+      memcpy( buffer->palette, RenderThread_Palette( this ), sizeof buffer->palette );
+   }
+   else {
+      Palette_Resolve( this );
+      memcpy( buffer->palette, this->palette_rgba, sizeof buffer->palette );
+   }
+   buffer->sample_count = ( ex->audio != NULL ) ? Nes_AudioRead( this, buffer->samples, Export_samples ) : 0;
+
+   pthread_mutex_lock( &ex->lock );
+   ex->count++;
+   pthread_cond_signal( &ex->ready );
+   pthread_mutex_unlock( &ex->lock );
+}
+
+// -------------------------------------------------------------------------------
+// Export every frame run from now on to `video`, in Export_rgb or Export_y4m `format`, and the samples of
+// the audio ring to `audio` as raw 16 bit mono, at the rate given to Nes_AudioEnable(). `audio` may be NULL.
+// The exporter is then the reader of the audio ring, don't call Nes_AudioRead() too. The files may be
+// pipes, they are not closed. `buffers` [2..4] is how many frames may wait for the writer, 3 lets the
+// emulation run a frame ahead of a writer that is about as fast. Returns false if it couldn't start.
+int Nes_ExportStart( Nes *this, FILE *video, FILE *audio, int format, int policy, int buffers )
+{
+   Nes_ExportStop( this );
+
+   if( buffers < 2 ) {
+      buffers = 2;
+   }
+   if( buffers > Export_max_buffers ) {
+      buffers = Export_max_buffers;
+   }
+   struct Nes_Export *ex = (struct Nes_Export*) calloc( 1, sizeof( struct Nes_Export ) );
+   if( ex == NULL ) {
+      return false;
+   }
+   ex->video = video;
+   ex->audio = audio;
+   ex->format = format;
+   ex->policy = policy;
+   ex->buffer_count = buffers;
+   ex->buffers = (Buffer*) malloc( buffers * sizeof( Buffer ) );
+   ex->packed = (byte*) malloc( 3 * Frame_pixels );
+   if( ex->buffers == NULL || ex->packed == NULL ) {
+      free( ex->buffers );
+      free( ex->packed );
+      free( ex );
+      return false;
+   }
+   pthread_mutex_init( &ex->lock, NULL );
+   pthread_cond_init( &ex->ready, NULL );
+   pthread_cond_init( &ex->freed, NULL );
+   if( pthread_create( &ex->writer, NULL, writer_main, ex ) != 0 ) {
+      pthread_mutex_destroy( &ex->lock );
+      pthread_cond_destroy( &ex->ready );
+      pthread_cond_destroy( &ex->freed );
+      free( ex->buffers );
+      free( ex->packed );
+      free( ex );
+      return false;
+   }
+   this->export = ex;
+   return true;
+}
+
+// Waits for the frames published so far to be written. Returns false if a write failed.
+int Nes_ExportStop( Nes *this )
+{
+   struct Nes_Export *ex = this->export;
+   if( ex == NULL ) {
+      return true;
+   }
+   pthread_mutex_lock( &ex->lock );
+   ex->quit = true;
+   pthread_cond_signal( &ex->ready );
+   pthread_mutex_unlock( &ex->lock );
+   pthread_join( ex->writer, NULL );
+
+   int written = ! ex->failed;
+   written &= fflush( ex->video ) == 0;
+   if( ex->audio != NULL ) {
+      written &= fflush( ex->audio ) == 0;
+   }
+   pthread_mutex_destroy( &ex->lock );
+   pthread_cond_destroy( &ex->ready );
+   pthread_cond_destroy( &ex->freed );
+   free( ex->buffers );
+   free( ex->packed );
+   free( ex );
+   this->export = NULL;
+   return written;
+}
+
+// Frames dropped by the Export_drop policy since the export started
+unsigned long Nes_ExportDropped( Nes *this )
+{
+   return ( this->export != NULL ) ? this->export->dropped : 0;
+}
@@ -0,0 +1,23 @@
+#ifndef _Export_h_
+   #define _Export_h_
+
+#include <stdio.h>
+#include "Nes.h"
+
+enum {
+   Export_rgb = 0, // Raw RGB24 frames, 256x240, no header
+   Export_y4m = 1  // YUV4MPEG2, 4:4:4 BT.601, at the NTSC frame rate
+};
+
+enum {
+   Export_block = 0, // Nes_DoFrame() waits for the writer when every buffer is taken
+   Export_drop  = 1  // The frame is dropped instead, see Nes_ExportDropped()
+};
+
+int  Nes_ExportStart( Nes *this, FILE *video, FILE *audio, int format, int policy, int buffers );
+int  Nes_ExportStop( Nes *this );
+unsigned long Nes_ExportDropped( Nes *this );
+
+void Export_Frame( Nes *this );
+
+#endif // #ifndef _Export_h_
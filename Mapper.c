@@ -0,0 +1,261 @@
+#include <string.h>
+#include "Nes.h"
+#include "Mapper.h"
+#include "MemoryAccess.h"
+
+#define NES ((Nes*)sys) // some syntax de-clutter to compensate for the unfortunate void *sys
+
+// Bank switching never copies memory: PRG windows are remapped in the CPU page table and CHR windows
+// are repointed at their (lazily) unpacked bank, so a switch costs a handful of pointer writes.
+// Bank numbers are in 8kB units for PRG and 1kB units for CHR, negative numbers count from the last bank.
+// Register writes sync the PPU first, since CHR banks and mirroring may change mid frame.
+
+// -------------------------------------------------------------------------------
+static void map_prg_16k( Nes *this, int window, int bank )
+{
+   Nes_MapPrg( this, window * 2,     bank * 2 );
+   Nes_MapPrg( this, window * 2 + 1, bank * 2 + 1 );
+}
+
+static void map_prg_32k( Nes *this, int bank )
+{
+   map_prg_16k( this, 0, bank * 2 );
+   map_prg_16k( this, 1, bank * 2 + 1 );
+}
+
+static void map_chr_4k( Nes *this, int window, int bank )
+{
+   for( int i = 0; i < 4; ++i ) {
+      Nes_MapChr( this, window * 4 + i, bank * 4 + i );
+   }
+}
+
+static void map_chr_8k( Nes *this, int bank )
+{
+   map_chr_4k( this, 0, bank * 2 );
+   map_chr_4k( this, 1, bank * 2 + 1 );
+}
+
+// -------------------------------------------------------------------------------
+// Mapper 0, NROM: 16 or 32kB of PRG-ROM, 8kB of CHR, no registers
+static void init_nrom( Nes *this )
+{
+   map_prg_16k( this, 0, 0 );
+   map_prg_16k( this, 1, -1 ); // Mirror of the first bank on NROM-128
+   map_chr_8k( this, 0 );
+}
+
+// -------------------------------------------------------------------------------
+// Mapper 2, UxROM: switchable 16kB at $8000, last 16kB fixed at $C000, CHR-RAM
+static void write_uxrom( void *sys, word address, byte value )
+{
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   map_prg_16k( NES, 0, value );
+}
+
+// -------------------------------------------------------------------------------
+// Mapper 3, CNROM: fixed PRG, switchable 8kB CHR
+static void write_cnrom( void *sys, word address, byte value )
+{
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   map_chr_8k( NES, value );
+}
+
+// -------------------------------------------------------------------------------
+// Mapper 1, MMC1: registers are loaded serially, 1 bit per write, the 5th write selects the register by address
+// http://wiki.nesdev.com/w/index.php/MMC1
+static void update_mmc1( Nes *this )
+{
+   byte control = this->mapper.reg[0];
+
+   static const byte mirroring[4] = {
+      mirroring_single_lower, mirroring_single_upper, mirroring_vertical, mirroring_horizontal
+   };
+   Nes_SetMirroring( this, mirroring[ control & 3 ] );
+
+   byte prg = this->mapper.reg[3] & 0x0F;
+   switch( ( control >>2 ) & 3 )
+   {
+      case 0:
+      case 1: // 32kB, low bit ignored
+         map_prg_32k( this, prg >>1 );
+         break;
+      case 2: // First bank fixed at $8000, switch $C000
+         map_prg_16k( this, 0, 0 );
+         map_prg_16k( this, 1, prg );
+         break;
+      case 3: // Switch $8000, last bank fixed at $C000
+         map_prg_16k( this, 0, prg );
+         map_prg_16k( this, 1, -1 );
+         break;
+   }
+
+   if( control & 0x10 ) { // Two 4kB banks
+      map_chr_4k( this, 0, this->mapper.reg[1] );
+      map_chr_4k( this, 1, this->mapper.reg[2] );
+   }
+   else { // 8kB, low bit ignored
+      map_chr_8k( this, this->mapper.reg[1] >>1 );
+   }
+}
+
+static void write_mmc1( void *sys, word address, byte value )
+{
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   if( value & 0x80 ) { // Reset the shift register and lock PRG to mode 3
+      NES->mapper.shift = 0;
+      NES->mapper.shift_count = 0;
+      NES->mapper.reg[0] |= 0x0C;
+      update_mmc1( NES );
+      return;
+   }
+
+   NES->mapper.shift |= ( value & 1 ) << NES->mapper.shift_count;
+   if( ++NES->mapper.shift_count == 5 )
+   {
+      NES->mapper.reg[ ( address >>13 ) & 3 ] = NES->mapper.shift; // $8000 control, $A000 CHR 0, $C000 CHR 1, $E000 PRG
+      NES->mapper.shift = 0;
+      NES->mapper.shift_count = 0;
+      update_mmc1( NES );
+   }
+}
+
+static void init_mmc1( Nes *this )
+{
+   this->mapper.reg[0] = 0x0C;
+   update_mmc1( this );
+}
+
+// -------------------------------------------------------------------------------
+// Mapper 4, MMC3: 8 bank registers selected through $8000, scanline counter IRQ
+// http://wiki.nesdev.com/w/index.php/MMC3
+static void update_mmc3( Nes *this )
+{
+   byte *r = this->mapper.reg;
+
+   if( this->mapper.bank_select & 0x40 ) {
+      Nes_MapPrg( this, 0, -2 );
+      Nes_MapPrg( this, 2, r[6] );
+   }
+   else {
+      Nes_MapPrg( this, 0, r[6] );
+      Nes_MapPrg( this, 2, -2 );
+   }
+   Nes_MapPrg( this, 1, r[7] );
+   Nes_MapPrg( this, 3, -1 );
+
+   int invert = ( this->mapper.bank_select & 0x80 ) ? 4 : 0; // Swap the 2kB and 1kB halves
+   Nes_MapChr( this, 0 ^ invert, r[0] & 0xFE );
+   Nes_MapChr( this, 1 ^ invert, r[0] | 1 );
+   Nes_MapChr( this, 2 ^ invert, r[1] & 0xFE );
+   Nes_MapChr( this, 3 ^ invert, r[1] | 1 );
+   Nes_MapChr( this, 4 ^ invert, r[2] );
+   Nes_MapChr( this, 5 ^ invert, r[3] );
+   Nes_MapChr( this, 6 ^ invert, r[4] );
+   Nes_MapChr( this, 7 ^ invert, r[5] );
+}
+
+static void write_mmc3( void *sys, word address, byte value )
+{
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   int odd = address & 1;
+   switch( address & 0xE000 )
+   {
+      case 0x8000:
+         if( odd ) {
+            NES->mapper.reg[ NES->mapper.bank_select & 7 ] = value;
+         }
+         else {
+            NES->mapper.bank_select = value;
+         }
+         update_mmc3( NES );
+         break;
+      case 0xA000:
+         if( ! odd && NES->ppu.mirroring != mirroring_4screens ) {
+            Nes_SetMirroring( NES, ( value & 1 ) ? mirroring_horizontal : mirroring_vertical );
+         }
+         // odd: PRG-RAM protect, ignored
+         break;
+      case 0xC000:
+         if( odd ) {
+            NES->mapper.irq_reload = 1;
+         }
+         else {
+            NES->mapper.irq_latch = value;
+         }
+         break;
+      case 0xE000:
+         NES->mapper.irq_enabled = odd;
+         if( ! odd ) {
+            NES->mapper.irq_pending = 0;
+         }
+         break;
+   }
+}
+
+// Clocked once per rendered scanline
+static void scanline_mmc3( void *sys )
+{
+   if( NES->mapper.irq_counter == 0 || NES->mapper.irq_reload ) {
+      NES->mapper.irq_counter = NES->mapper.irq_latch;
+      NES->mapper.irq_reload = 0;
+   }
+   else {
+      NES->mapper.irq_counter--;
+   }
+   if( NES->mapper.irq_counter == 0 && NES->mapper.irq_enabled ) {
+      NES->mapper.irq_pending = 1; // WIP the Cpu6502 core has no IRQ input to assert yet
+   }
+}
+
+static void init_mmc3( Nes *this )
+{
+   update_mmc3( this );
+}
+
+// -------------------------------------------------------------------------------
+// Set up the power on banks and route writes to $8000..$FFFF to the mapper registers.
+// Returns false for mappers not supported yet.
+int Mapper_Init( Nes *this, int id )
+{
+   void (*write)( void *sys, word address, byte value ) = write_ignore;
+
+   memset( &this->mapper, 0, sizeof this->mapper );
+   this->mapper.id = id;
+   this->mapper_scanline = NULL;
+
+   switch( id )
+   {
+      case Mapper_NROM:
+         init_nrom( this );
+         break;
+      case Mapper_MMC1:
+         init_mmc1( this );
+         write = write_mmc1;
+         break;
+      case Mapper_UxROM:
+         init_nrom( this );
+         write = write_uxrom;
+         break;
+      case Mapper_CNROM:
+         init_nrom( this );
+         write = write_cnrom;
+         break;
+      case Mapper_MMC3:
+         init_mmc3( this );
+         write = write_mmc3;
+         this->mapper_scanline = scanline_mmc3;
+         break;
+      default:
+         return false;
+   }
+
+   for( int i = 0x8000; i <= 0xFFFF; ++i ) {
+      this->cpu->write_memory[i] = write;
+   }
+   return true;
+}
@@ -0,0 +1,17 @@
+#ifndef _Mapper_h_
+   #define _Mapper_h_
+
+#include "Nes.h"
+
+// iNES mapper numbers supported so far
+enum {
+   Mapper_NROM  = 0,
+   Mapper_MMC1  = 1,
+   Mapper_UxROM = 2,
+   Mapper_CNROM = 3,
+   Mapper_MMC3  = 4
+};
+
+int Mapper_Init( Nes *this, int id );
+
+#endif // #ifndef _Mapper_h_
@@ -1,62 +1,57 @@
 #include <string.h>
 #include <assert.h>
 #include "Nes.h"
+#include "RenderThread.h"
 
 #define NES ((Nes*)sys) // some syntax de-clutter to compensate for the unfortunate void *sys
 
 // -------------------------------------------------------------------------------
-// $0..$7FF unmirrored RAM
+// Regions backed by host memory: RAM and its mirrors, save RAM, PRG-ROM. The external Cpu6502 core only
+// calls through its per address tables, so each region gets a handler with its mirroring folded into a
+// mask rather than a page table lookup. In-core reads go through read_page, see Nes_ReadMemory().
 byte read_ram( void *sys, word address )
 {
-	return NES->ram[address];
+   profile_read( NES, address );
+   return NES->ram[ address & 0x7FF ];
 }
 
 void write_ram( void *sys, word address, byte value )
 {
-	NES->ram[address] = value;
+   profile_write( NES, address );
+   NES->ram[ address & 0x7FF ] = value;
 }
 
-// -------------------------------------------------------------------------------
-// $800..$1FFF mirrored RAM
-byte read_ram_mirror( void *sys, word address )
-{
-	return NES->ram[address & 0x7FF]; // Convert mirrors to actual address
-}
-
-void write_ram_mirror( void *sys, word address, byte value )
-{
-	NES->ram[address & 0x7FF] = value; // Convert mirrors to actual address
-}
-
-// -------------------------------------------------------------------------------
 byte read_save_ram( void *sys, word address )
 {
-   return NES->save_ram[ address - 0x6000 ];
+   profile_read( NES, address );
+   return NES->save_ram[ address & 0x1FFF ];
 }
 
 void write_save_ram( void *sys, word address, byte value )
 {
-   NES->save_ram[ address - 0x6000 ] = value;
+   profile_write( NES, address );
+   NES->save_ram[ address & 0x1FFF ] = value;
 }
 
-// -------------------------------------------------------------------------------
-// $8000..$FFFF PRG-ROM
-byte read_prg_rom( void *sys, word address )
+byte read_prg( void *sys, word address )
 {
-	address -= 0x8000; // make address zero-based ( $0..$7FFF )
-	if( NES->prg_rom_count == 1 ) // WIP bankswitching hell here in the future
-	{
-		address &= 0x3FFF; // Convert mirror in actual ROM address ( $0..$3FFF )		
-	}
-	return NES->prg_rom[address];
+   profile_read( NES, address );
+   return NES->prg_ptr[ ( address >>13 ) & 3 ][ address & 0x1FFF ];
 }
 
 // -------------------------------------------------------------------------------
 // $2000
 void write_ppu_control1( void *sys, word address, byte value )
 {
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   NES->next_event = NES->ppu_cycles; // Sprite 0 hit may move, reschedule
    NES->ppu.nmi_enabled    = ( value & (1<<7) ) ? 1 : 0;
-   NES->ppu.sprite_height  = ( value & (1<<5) ) ? 16 : 8;
+   byte sprite_height = ( value & (1<<5) ) ? 16 : 8;
+   if( sprite_height != NES->ppu.sprite_height ) {
+      NES->sprites_dirty = true;
+   }
+   NES->ppu.sprite_height  = sprite_height;
    NES->ppu.back_pattern   = ( value & (1<<4) ) ? 0x1000 : 0;
    NES->ppu.sprite_pattern = ( value & (1<<3) ) ? 0x1000 : 0;
    NES->ppu.increment_vram = ( value & (1<<2) ) ? 32 : 1;
@@ -66,17 +61,27 @@ void write_ppu_control1( void *sys, word address, byte value )
 // $2001
 void write_ppu_control2( void *sys, word address, byte value )
 {
-   NES->ppu.color_emphasis     = ( value & 0xE0 ) >>5; // & %11100000
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   NES->next_event = NES->ppu_cycles; // Sprite 0 hit may move, reschedule
+   byte color_emphasis = ( value & 0xE0 ) >>5; // & %11100000
+   byte monochrome     = ( value & (1<<0) ) ? 1 : 0;
+   if( color_emphasis != NES->ppu.color_emphasis || monochrome != NES->ppu.monochrome ) {
+      NES->palette_dirty = true;
+   }
+   NES->ppu.color_emphasis     = color_emphasis;
    NES->ppu.sprites_visible    = ( value & (1<<4) ) ? 1 : 0;
    NES->ppu.background_visible = ( value & (1<<3) ) ? 1 : 0;
    NES->ppu.sprite_clip        = ( value & (1<<2) ) ? 0 : 1;
    NES->ppu.background_clip    = ( value & (1<<1) ) ? 0 : 1;
-   NES->ppu.monochrome         = ( value & (1<<1) ) ? 1 : 0;
+   NES->ppu.monochrome         = monochrome;
 }
 // -------------------------------------------------------------------------------
 // $2002
 byte read_ppu_status( void *sys, word address )
 {
+   profile_read( NES, address );
+   Nes_SyncPpu( NES ); // Sprite overflow is set as lines are rendered, catch up to the current one
    // Unused bits should actually return the open bus
    byte value = 
       ( NES->ppu.vblank_flag  <<7 ) |
@@ -96,24 +101,41 @@ byte read_ppu_status( void *sys, word address )
 // $2003
 void write_spr_ram_address( void *sys, word address, byte value  )
 {
-//   assert( 0 && "sprite RAM address register not yet implemented"  );
+   profile_write( NES, address );
+   NES->ppu.oam_address = value;
 }
 // -------------------------------------------------------------------------------
 // $2004
 byte read_spr_ram_io( void *sys, word address )
 {
-//   assert( 0 && "Read from sprite RAM not yet implemented"  );
-   return 0;
+   profile_read( NES, address );
+   byte value = NES->ppu.sprites[ NES->ppu.oam_address ]; // Reads don't increment the address
+   
+   #ifdef _Cpu6502_Disassembler
+      NES->cpu->disasm.value = value;
+   #endif
+   
+   return value;
 }
 // -------------------------------------------------------------------------------
 void write_spr_ram_io( void *sys, word address, byte value  )
 {
-//   assert( 0 && "Write to sprite RAM not yet implemented"  );
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   if( NES->vram_logging ) {
+      Render_LogWrite( NES, Log_oam, NES->ppu.oam_address, value );
+   }
+   NES->ppu.sprites[ NES->ppu.oam_address++ ] = value;
+   NES->sprites_dirty = true;
+   NES->next_event = NES->ppu_cycles; // Sprite 0 may have moved, reschedule
 }
 // -------------------------------------------------------------------------------
 // $2005
 void write_scroll( void *sys, word address, byte value  )
 {
+   profile_write( NES, address );
+   Nes_SyncPpu( NES );
+   NES->next_event = NES->ppu_cycles; // Sprite 0 hit may move, reschedule
    if( NES->ppu.write_count == 0 ) {
       NES->ppu.horz_scroll = value;
       NES->ppu.write_count = 1;
@@ -127,6 +149,9 @@ void write_scroll( void *sys, word address, byte value  )
 // $2006
 void write_vram_address( void *sys, word register_address, byte value  )
 {
+   profile_write( NES, register_address );
+   Nes_SyncPpu( NES );
+   NES->next_event = NES->ppu_cycles; // Sprite 0 hit may move, reschedule
    if( NES->ppu.write_count == 0 ) {
       NES->ppu.vram_address = ((word) value & 0x3F ) <<8; // put 6 bits of value in vram_address msb
       NES->ppu.write_count = 1;
@@ -140,6 +165,7 @@ void write_vram_address( void *sys, word register_address, byte value  )
 // $2007
 byte read_vram_io( void *sys, word register_address )
 {
+   profile_read( NES, register_address );
    byte old_latch = NES->ppu.vram_latch;
    
    if( NES->ppu.write_count > 0 ) {
@@ -160,19 +186,21 @@ byte read_vram_io( void *sys, word register_address )
       NES->ppu.vram_latch = NES->ppu.palettes[ vram_address ];
       return NES->ppu.vram_latch;
    }
-   // Name tables and attributes
-   else if( vram_address < 0x3F00 ) {
-      vram_address &= 0x7FF; // Make VRAM address zero based and Unmirror
-      NES->ppu.vram_latch = NES->ppu.name_attr[ vram_address ];
+   // Name tables and attributes, $3000..$3EFF mirror $2000..$2EFF
+   else if( vram_address >= 0x2000 ) {
+      NES->ppu.vram_latch = NES->name_ptr[ ( vram_address >>10 ) & 3 ][ vram_address & 0x3FF ];
    }
+   // Pattern tables
    else {
-      assert(0 && "Reading Pattern tables.");
+      NES->ppu.vram_latch = NES->chr_ptr[ vram_address >>10 ][ vram_address & 0x3FF ];
    }
    return old_latch;
 }
 // -------------------------------------------------------------------------------
 void write_vram_io( void *sys, word register_address, byte value  )
 {
+   profile_write( NES, register_address );
+   Nes_SyncPpu( NES );
    if( NES->ppu.write_count > 0 ) {
       assert( 0 && "Trying to write to VRAM after only setting half of VRAM address, what to do here?" );
    }
@@ -188,28 +216,55 @@ void write_vram_io( void *sys, word register_address, byte value  )
          vram_address -= 0x10; // Sprite colors 0 mirror background colors 0
       }
       NES->ppu.palettes[ vram_address ] = value & 0x3F;
+      NES->palette_dirty = true;
+   }
+   // Name tables and attributes, $3000..$3EFF mirror $2000..$2EFF
+   else if( vram_address >= 0x2000 ) {
+      byte *entry = &NES->name_ptr[ ( vram_address >>10 ) & 3 ][ vram_address & 0x3FF ];
+      if( *entry != value ) {
+         if( NES->vram_logging ) {
+            Render_LogWrite( NES, Log_name, entry - NES->ppu.name_attr, value );
+         }
+         Render_NameChanged( NES, entry - NES->ppu.name_attr, *entry ^ value );
+         *entry = value;
+      }
    }
-   // Name tables and attributes
-   else if( NES->ppu.vram_address < 0x3F00 ) {
-      vram_address &= 0x7FF; // Make VRAM address zero based and Unmirror
-      NES->ppu.name_attr[ vram_address ] = value;
+   // Pattern tables, only writable with CHR-RAM
+   else {
+      if( NES->vram_logging && NES->chr_writable ) {
+         int bank = NES->mapper.chr_bank[ vram_address >>10 ];
+         Render_LogWrite( NES, Log_chr, bank * CHR_bank_size + ( vram_address & 0x3FF ), value );
+      }
+      Nes_WriteChr( NES, vram_address, value );
    }
-   // else tries to write to pattern tables, do nothing for now
    
    NES->ppu.vram_address += NES->ppu.increment_vram;
    NES->ppu.vram_address &= 0x3FFF; // Wrap around $4000
 }
 // -------------------------------------------------------------------------------
 // $4014
-// WIP: OAM DMA starts on RAM address written to $2003
+// Copies a page to OAM starting at the OAM address, wrapping around, like 256 writes to $2004
 void write_sprite_dma( void *sys, word address, byte value )
 {
-   if( value > 0x1F ) {
-      assert( 0 && "Copying sprite DMA from outside RAM, weird." );
+   profile_write( NES, address );
+   const byte *page = NES->read_page[value];
+   if( page == NULL ) {
+      assert( 0 && "Copying sprite DMA from an I/O page, weird." );
+      return;
+   }
+   Nes_SyncPpu( NES );
+   int first = NES->ppu.oam_address;
+   if( NES->vram_logging ) {
+      for( int i = 0; i < 0x100; ++i ) {
+         Render_LogWrite( NES, Log_oam, ( first + i ) & 0xFF, page[i] );
+      }
    }
-   address = ( value & 0x7 ) <<8; // shamelessly reusing unused `address`
-   memcpy( NES->ppu.sprites, &NES->ram[address], 0x100 );
+   memcpy( &NES->ppu.sprites[first], page, 0x100 - first );
+   memcpy( NES->ppu.sprites, &page[ 0x100 - first ], first );
+   NES->sprites_dirty = true;
+   NES->next_event = NES->ppu_cycles; // Sprite 0 may have moved, reschedule
    int cpu_cycles = ( NES->cpu_cycles % 2 == 1 ) ? 514 : 513; // +1 cycle on odd CPU cycles
+   profile_dma( NES, cpu_cycles );
    NES->cpu_cycles += cpu_cycles;
    NES->ppu_cycles += 3 * cpu_cycles;
 }
@@ -217,6 +272,7 @@ void write_sprite_dma( void *sys, word address, byte value )
 // $4016
 byte read_gamepad( void *sys, word address )
 {
+   profile_read( NES, address );
    byte value = 0;
    if( NES->input.strobe_state == Nes_Strobe_clear )
    {
@@ -239,7 +295,8 @@ byte read_gamepad( void *sys, word address )
 
 void write_gamepad( void *sys, word address, byte value )
 {
-   // Ignore writes to 0x4017 for now
+   profile_write( NES, address );
+   // Writes to $4017 go to the APU frame counter
    if( address == 0x4016 )
    {
       if( value == 1 ) {
@@ -1,10 +1,8 @@
 byte read_ram( void *sys, word address );
 void write_ram( void *sys, word address, byte value );
-byte read_ram_mirror( void *sys, word address );
-void write_ram_mirror( void *sys, word address, byte value );
 byte read_save_ram( void *sys, word address );
 void write_save_ram( void *sys, word address, byte value );
-byte read_prg_rom( void *sys, word address );
+byte read_prg( void *sys, word address );
 void write_ppu_control1( void *sys, word address, byte value );
 void write_ppu_control2( void *sys, word address, byte value );
 byte read_ppu_status( void *sys, word address );
@@ -17,7 +15,11 @@ byte read_vram_io( void *sys, word address );
 void write_vram_io( void *sys, word address, byte value  );
 void write_sprite_dma( void *sys, word address, byte value );
 void write_vram_io( void *sys, word address, byte value  );
+void write_apu( void *sys, word address, byte value );
+byte read_apu_status( void *sys, word address );
 byte read_gamepad( void *sys, word address );
 void write_gamepad( void *sys, word address, byte value );
+byte read_ignore( void *sys, word address );
+void write_ignore( void *sys, word address, byte value );
 byte read_unimplemented( void *sys, word address );
 void write_unimplemented( void *sys, word address, byte value );
\ No newline at end of file
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "Movie.h"
+
+// File layout: Movie_header, frames * 2 bytes of input, then frames * 8 bytes of RAM hashes if flagged
+#define Movie_version 1
+#define Movie_has_hashes 1
+
+typedef struct
+{
+   char magic[4];    // "NESm"
+   uint32_t version;
+   uint32_t frames;
+   uint32_t flags;
+} Movie_header;
+
+// -------------------------------------------------------------------------------
+Nes_Movie *Nes_MovieCreate( int with_hashes )
+{
+   Nes_Movie *movie = (Nes_Movie*) calloc( 1, sizeof( Nes_Movie ) );
+   if( movie == NULL ) {
+      return NULL;
+   }
+   movie->capacity = 60 * 60; // A minute, grows as needed
+   movie->input = (byte*) malloc( movie->capacity * 2 );
+   movie->hashes = with_hashes ? (uint64_t*) malloc( movie->capacity * sizeof( uint64_t ) ) : NULL;
+   if( movie->input == NULL || ( with_hashes && movie->hashes == NULL ) ) {
+      Nes_MovieFree( movie );
+      return NULL;
+   }
+   return movie;
+}
+
+void Nes_MovieFree( Nes_Movie *movie )
+{
+   if( movie == NULL ) {
+      return;
+   }
+   free( movie->input );
+   free( movie->hashes );
+   free( movie );
+}
+
+// -------------------------------------------------------------------------------
+Nes_Movie *Nes_MovieLoad( const char *path )
+{
+   FILE *file = fopen( path, "rb" );
+   if( file == NULL ) {
+      return NULL;
+   }
+   Movie_header header;
+   Nes_Movie *movie = NULL;
+   if( fread( &header, sizeof header, 1, file ) == 1 && memcmp( header.magic, "NESm", 4 ) == 0
+      && header.version == Movie_version && header.frames < ( 1u << 30 ) )
+   {
+      movie = (Nes_Movie*) calloc( 1, sizeof( Nes_Movie ) );
+      if( movie != NULL ) {
+         movie->frames = movie->capacity = header.frames;
+         movie->input = (byte*) malloc( header.frames * 2 + 1 );
+         if( header.flags & Movie_has_hashes ) {
+            movie->hashes = (uint64_t*) malloc( header.frames * sizeof( uint64_t ) + 1 );
+         }
+         if( movie->input == NULL || ( ( header.flags & Movie_has_hashes ) && movie->hashes == NULL )
+            || fread( movie->input, 2, header.frames, file ) != header.frames
+            || ( movie->hashes != NULL && fread( movie->hashes, sizeof( uint64_t ), header.frames, file ) != header.frames ) )
+         {
+            Nes_MovieFree( movie );
+            movie = NULL;
+         }
+      }
+   }
+   if( movie == NULL ) {
+      fprintf( stderr, "Couldn't load movie %s.\n", path );
+   }
+   fclose( file );
+   return movie;
+}
+
+int Nes_MovieSave( const Nes_Movie *movie, const char *path )
+{
+   FILE *file = fopen( path, "wb" );
+   if( file == NULL ) {
+      return false;
+   }
+   Movie_header header;
+   memcpy( header.magic, "NESm", 4 );
+   header.version = Movie_version;
+   header.frames  = movie->frames;
+   header.flags   = ( movie->hashes != NULL ) ? Movie_has_hashes : 0;
+   int ok = fwrite( &header, sizeof header, 1, file ) == 1
+      && fwrite( movie->input, 2, movie->frames, file ) == (size_t) movie->frames
+      && ( movie->hashes == NULL || fwrite( movie->hashes, sizeof( uint64_t ), movie->frames, file ) == (size_t) movie->frames );
+   return ( fclose( file ) == 0 ) && ok;
+}
+
+// -------------------------------------------------------------------------------
+// Append the frames run from now on to `movie`, the gamepad state is taken when each frame starts
+int Nes_MovieRecord( Nes *this, Nes_Movie *movie )
+{
+   this->movie = movie;
+   this->movie_mode = Movie_recording;
+   this->movie_frame = movie->frames;
+   this->movie_mismatch = -1;
+   return true;
+}
+
+// Feed the gamepads from `movie` starting with the next frame. The movie should start right after a reset
+// or from the save state it was recorded from. The position in the movie is kept outside the state block,
+// so loading a state or rewinding while it plays doesn't move it and desyncs the playback.
+void Nes_MoviePlay( Nes *this, const Nes_Movie *movie )
+{
+   this->movie = (Nes_Movie*) movie; // Not modified while playing
+   this->movie_mode = Movie_playing;
+   this->movie_frame = 0;
+   this->movie_mismatch = -1;
+}
+
+void Nes_MovieStop( Nes *this )
+{
+   this->movie = NULL;
+   this->movie_mode = Movie_off;
+}
+
+// true while there are frames left to play
+int Nes_MoviePlaying( Nes *this )
+{
+   return this->movie_mode == Movie_playing && this->movie_frame < this->movie->frames;
+}
+
+// First frame whose RAM hash didn't match the movie's, -1 while playback is in sync
+int Nes_MovieMismatch( Nes *this )
+{
+   return this->movie_mismatch;
+}
+
+// -------------------------------------------------------------------------------
+uint64_t Movie_HashRam( Nes *this )
+{
+   uint64_t hash = 0xCBF29CE484222325ull; // FNV-1a
+   for( size_t i = 0; i < sizeof this->ram; ++i ) {
+      hash = ( hash ^ this->ram[i] ) * 0x100000001B3ull;
+   }
+   return hash;
+}
+
+static int grow( Nes_Movie *movie )
+{
+   int capacity = movie->capacity * 2;
+   byte *input = (byte*) realloc( movie->input, capacity * 2 );
+   if( input == NULL ) {
+      return false;
+   }
+   movie->input = input;
+   if( movie->hashes != NULL ) {
+      uint64_t *hashes = (uint64_t*) realloc( movie->hashes, capacity * sizeof( uint64_t ) );
+      if( hashes == NULL ) {
+         return false;
+      }
+      movie->hashes = hashes;
+   }
+   movie->capacity = capacity;
+   return true;
+}
+
+// Called by Nes_DoFrame() before running a frame
+void Movie_BeginFrame( Nes *this )
+{
+   Nes_Movie *movie = this->movie;
+   int frame = this->movie_frame;
+   if( this->movie_mode == Movie_recording )
+   {
+      if( frame >= movie->capacity && ! grow( movie ) ) {
+         fprintf( stderr, "Out of memory recording movie, stopped at frame %d.\n", frame );
+         Nes_MovieStop( this );
+         return;
+      }
+      movie->input[ frame * 2 ]     = Nes_GetGamepad( this, 0 );
+      movie->input[ frame * 2 + 1 ] = Nes_GetGamepad( this, 1 );
+   }
+   else if( frame < movie->frames ) {
+      Nes_SetGamepad( this, 0, movie->input[ frame * 2 ] );
+      Nes_SetGamepad( this, 1, movie->input[ frame * 2 + 1 ] );
+   }
+   else { // Past the end, gamepads are released
+      Nes_SetGamepad( this, 0, 0 );
+      Nes_SetGamepad( this, 1, 0 );
+   }
+}
+
+// Called by Nes_DoFrame() after running a frame
+void Movie_EndFrame( Nes *this )
+{
+   Nes_Movie *movie = this->movie;
+   int frame = this->movie_frame;
+   if( this->movie_mode == Movie_recording )
+   {
+      if( movie->hashes != NULL ) {
+         movie->hashes[frame] = Movie_HashRam( this );
+      }
+      movie->frames = frame + 1;
+   }
+   else if( frame < movie->frames && movie->hashes != NULL && this->movie_mismatch < 0 ) {
+      if( movie->hashes[frame] != Movie_HashRam( this ) ) {
+         this->movie_mismatch = frame;
+      }
+   }
+   this->movie_frame++;
+}
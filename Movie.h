@@ -0,0 +1,39 @@
+#ifndef _Movie_h_
+   #define _Movie_h_
+
+#include <stdint.h>
+#include "Nes.h"
+
+// Input movie: the state of both gamepads for each frame, packed as in Nes_SetGamepad(), and optionally a
+// hash of RAM after each frame to check that playback is still in sync. A movie isn't modified while it
+// plays, so any number of instances may play the same one at once.
+typedef struct Nes_Movie
+{
+   int frames;
+   int capacity;
+   byte *input;       // input[ frame * 2 + gamepad ]
+   uint64_t *hashes;  // RAM hash after each frame, NULL if the movie has none
+} Nes_Movie;
+
+enum {
+   Movie_off       = 0,
+   Movie_recording = 1,
+   Movie_playing   = 2
+};
+
+Nes_Movie *Nes_MovieCreate( int with_hashes );
+Nes_Movie *Nes_MovieLoad( const char *path );
+int        Nes_MovieSave( const Nes_Movie *movie, const char *path );
+void       Nes_MovieFree( Nes_Movie *movie );
+
+int  Nes_MovieRecord( Nes *this, Nes_Movie *movie );
+void Nes_MoviePlay( Nes *this, const Nes_Movie *movie );
+void Nes_MovieStop( Nes *this );
+int  Nes_MoviePlaying( Nes *this );
+int  Nes_MovieMismatch( Nes *this );
+
+uint64_t Movie_HashRam( Nes *this );
+void Movie_BeginFrame( Nes *this );
+void Movie_EndFrame( Nes *this );
+
+#endif // #ifndef _Movie_h_
@@ -1,17 +1,26 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
 #include "Nes.h"
+#include "Decode.h"
+#include "Export.h"
+#include "Movie.h"
+#include "RenderThread.h"
+#include "Rewind.h"
+#include "Rom.h"
 
-// How many PPU cycles until starting VBlank. 262 scanlines * 341 ppu cycles (one per pixel)
-#define VBlank_ppu_cycles 262 * 341
-#define VBlank_end_ppu_cycles 20 * 341
+// PPU cycles from the start of the pre-render scanline (-1), 341 ppu cycles per scanline (one per pixel)
+#define VBlank_ppu_cycles ( 242 * 341 ) // Start of scanline 241
+#define Frame_ppu_cycles  ( 262 * 341 ) // Scanlines -1..260
 
 #ifdef _Cpu6502_Disassembler
    static byte read_memory_disasm( void *parent_system, word address );
 #endif
 static void init_builtin_memory_handlers( Nes *this );
+static void map_pages( Nes *this, int first, int last, const byte *memory, int size );
 
 // -------------------------------------------------------------------------------
 static void initialize( Nes *this )
@@ -31,6 +40,10 @@ static void initialize( Nes *this )
    this->ppu.sprite_clip        = 0;
    this->ppu.background_clip    = 0;
    this->ppu.monochrome         = 0;
+   this->palette_dirty          = true;
+   this->sprites_dirty          = true;
+   this->background_dirty       = true;
+   Nes_ForgetIdleLoop( this );
 
    this->ppu.vblank_flag  = 0;
    this->ppu.sprite0_hit  = 0;
@@ -40,7 +53,7 @@ static void initialize( Nes *this )
    this->ppu.horz_scroll  = 0;
    this->ppu.vert_scroll  = 0;
    this->ppu.vram_address = 0;
-   this->ppu.mirroring    = 0;
+   this->ppu.oam_address  = 0;
    
    this->cpu_cycles      = 0;
    this->ppu_cycles      = 0;
@@ -48,7 +61,10 @@ static void initialize( Nes *this )
    this->scanline        = -1;
    this->scanpixel       = 0;
    this->vblank          = 0;
-   this->last_scanpixel  = 0;
+   this->frame_start     = 0;
+   this->next_event      = 0;
+   this->next_line       = -1;
+   Apu_Reset( this );
    
    memset( this->input.gamepad,    0, sizeof this->input.gamepad );
    memset( this->input.read_count, 0, sizeof this->input.read_count );
@@ -64,6 +80,7 @@ Nes *Nes_Create()
       
    this->cpu = Cpu6502_Create( this );
    if( this->cpu == NULL ) {
+      free( this );
       return NULL;
    }
    Cpu6502_Initialize( this->cpu );
@@ -72,21 +89,56 @@ Nes *Nes_Create()
       this->cpu->read_memory_disasm = read_memory_disasm;
    #endif
    
+   this->rom = NULL;
    this->prg_rom_count = 0;
    this->prg_rom = NULL;
    this->chr_rom_count = 0;
    this->chr_rom = NULL;
-
-   memset( this->ram, 0, 0x800 );
-   memset( this->save_ram, 0, 0x2000 );
-   
-   this->ppu.name_attr = (byte *) malloc( 0x800 );
-   memset( this->ppu.name_attr, 0xFF, 0x800 );
-   memset( this->ppu.name_ptr, 0, 4 );
-   memset( this->ppu.attr_ptr, 0, 4 );
-   memset( this->ppu.palettes, 0, 0x20 );
-   memset( this->ppu.sprites, 0, 0x100 );
+   this->chr_writable = 0;
    this->chr_unpacked = NULL;
+   this->chr_opaque = NULL;
+   this->chr_decoded = NULL;
+   memset( this->chr_ptr, 0, sizeof this->chr_ptr );
+   memset( this->chr_unpacked_ptr, 0, sizeof this->chr_unpacked_ptr );
+   memset( this->chr_opaque_ptr, 0, sizeof this->chr_opaque_ptr );
+   memset( this->name_ptr, 0, sizeof this->name_ptr );
+   memset( this->attr_ptr, 0, sizeof this->attr_ptr );
+   this->mapper_scanline = NULL;
+   this->rewind = NULL;
+   this->audio = NULL;
+   this->movie = NULL;
+   this->movie_mode = 0;
+   this->export = NULL;
+   this->instructions = 0;
+   this->idle_skip = true;
+   Nes_ForgetIdleLoop( this );
+   this->render_skip = 0;
+   this->line_state_count = 0;
+   memset( this->line_state, 0xFF, sizeof this->line_state );
+   this->render_thread = NULL;
+   this->vram_logging = false;
+   this->vram_writes = NULL;
+   this->vram_write_count = 0;
+   this->vram_write_capacity = 0;
+   Nes_ResetProfile( this );
+   
+   memset( (byte*) this + Nes_state_offset, 0, Nes_state_size );
+   memset( this->ppu.name_attr, 0xFF, sizeof this->ppu.name_attr );
+   this->ppu.mirroring = mirroring_vertical;
+   
+   this->framebuffer = (byte *) malloc( Nes_screen_width * Nes_screen_height );
+   this->background_plane = (byte *) malloc( 4 * Nes_screen_width * Nes_screen_height );
+   if( this->framebuffer == NULL || this->background_plane == NULL ) {
+      free( this->framebuffer );
+      free( this->background_plane );
+      free( this->cpu );
+      free( this );
+      return NULL;
+   }
+   memset( this->framebuffer, 0, Nes_screen_width * Nes_screen_height );
+   this->own_framebuffer = this->framebuffer;
+   memset( this->plane_chr, 0, sizeof this->plane_chr );
+   this->patterns_dirty = false;
 
    initialize( this );
    init_builtin_memory_handlers( this );
@@ -97,67 +149,152 @@ Nes *Nes_Create()
 // -------------------------------------------------------------------------------
 void Nes_Free( Nes *this )
 {
-   if( this->prg_rom != NULL ) {
-      free( this->prg_rom );
-   }
-   if( this->chr_rom != NULL ) {
-      free( this->chr_rom );
+   Rom_Detach( this );
+   Nes_RewindDisable( this );
+   Nes_ExportStop( this );
+   Nes_AudioDisable( this );
+   free( this->own_framebuffer );
+   free( this->background_plane );
+   free( this->vram_writes );
+   free( this->cpu );
+   free( this );
+}
+
+// -------------------------------------------------------------------------------
+// Spreads the 8 bits of a CHR plane byte into the 8 bytes of a 64 bit word, leftmost pixel (bit 7) in the
+// lowest byte, so a whole tile row is decoded with two lookups: spread[lsb] | spread[msb] <<1
+// The rows are stored with memcpy(), lowest byte first in memory only on little endian hosts.
+#if defined( __BYTE_ORDER__ ) && ( __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__ )
+   #error "chr_spread and unpack_tiles() assume a little endian host"
+#endif
+#define spread(b) ( \
+   (uint64_t)( ( (b) >>7 ) & 1 )       | (uint64_t)( ( (b) >>6 ) & 1 ) <<8  | \
+   (uint64_t)( ( (b) >>5 ) & 1 ) <<16  | (uint64_t)( ( (b) >>4 ) & 1 ) <<24 | \
+   (uint64_t)( ( (b) >>3 ) & 1 ) <<32  | (uint64_t)( ( (b) >>2 ) & 1 ) <<40 | \
+   (uint64_t)( ( (b) >>1 ) & 1 ) <<48  | (uint64_t)(   (b)        & 1 ) <<56 )
+#define spread4(b)   spread(b),    spread(b+1),    spread(b+2),    spread(b+3)
+#define spread16(b)  spread4(b),   spread4(b+4),   spread4(b+8),   spread4(b+12)
+#define spread64(b)  spread16(b),  spread16(b+16), spread16(b+32), spread16(b+48)
+
+static const uint64_t chr_spread[0x100] = {
+   spread64(0), spread64(0x40), spread64(0x80), spread64(0xC0)
+};
+
+// Decode `tiles` packed 16 byte tiles into 64 bytes each, 1 byte per pixel, and the 8 opacity masks of each
+static void unpack_tiles( const byte *chr, byte *unpacked, byte *opaque, int tiles )
+{
+   for( int tile = 0; tile < tiles; ++tile )
+   {
+      for( int line = 0; line <= 7; ++line )
+      {
+         uint64_t row = chr_spread[ chr[line] ] | ( chr_spread[ chr[line + 8] ] <<1 );
+         memcpy( unpacked, &row, 8 );
+         unpacked += 8;
+         *opaque++ = chr[line] | chr[line + 8];
+      }
+      chr += 16;
    }
-   if( this->chr_unpacked != NULL ) {
-      free( this->chr_unpacked );
+}
+
+// -------------------------------------------------------------------------------
+// Point 1kB window [0..7] of PPU $0000..$1FFF at 1kB CHR bank `bank`, unpacking it if never done before
+void Nes_MapChr( Nes *this, int window, int bank )
+{
+   if( this->chr_rom_count == 0 ) { // No ROM, a mapper write after Rom_Detach()
+      return;
    }
-      free( this->ppu.name_attr );
+   bank %= this->chr_rom_count * CHR_banks_per_rom_bank;
+   byte *unpacked = &this->chr_unpacked[ bank * CHR_UNPACKED_bank_size ];
+   byte *opaque = &this->chr_opaque[ bank * CHR_OPAQUE_bank_size ];
+   if( atomic_load_explicit( &this->chr_decoded[bank], memory_order_acquire ) != 2 )
+   {
+      // The unpacked banks may be shared, whoever gets to flag the bank first decodes it
+      unsigned char packed = 0;
+      if( atomic_compare_exchange_strong( &this->chr_decoded[bank], &packed, 1 ) ) {
+         unpack_tiles( &this->chr_rom[ bank * CHR_bank_size ], unpacked, opaque, CHR_bank_size / 16 );
+         atomic_store_explicit( &this->chr_decoded[bank], 2, memory_order_release );
+      }
+      else {
+         while( atomic_load_explicit( &this->chr_decoded[bank], memory_order_acquire ) != 2 ) {
+            sched_yield(); // Another instance is decoding it, a few microseconds
+         }
+      }
    }
-   free( this );
+   this->chr_unpacked_ptr[window] = unpacked;
+   this->chr_opaque_ptr[window] = opaque;
+   this->chr_ptr[window] = &this->chr_rom[ bank * CHR_bank_size ];
+   this->mapper.chr_bank[window] = bank;
+   this->next_event = this->ppu_cycles; // Sprite 0 hit may move, reschedule
 }
 
 // -------------------------------------------------------------------------------
-void Nes_UnpackChrRom( Nes *this )
+// Write to the pattern tables, only CHR-RAM cartridges allow it. The touched tile row is unpacked again.
+void Nes_WriteChr( Nes *this, word address, byte value )
 {
-   if( this->chr_unpacked != NULL ) {
-      free( this->chr_unpacked );
+   Nes_WriteChrBank( this, this->mapper.chr_bank[ ( address >>10 ) & 7 ], address & 0x3FF, value );
+}
+
+// Same for byte `offset` of 1kB CHR-RAM bank `bank`, whether it is mapped or not
+void Nes_WriteChrBank( Nes *this, int bank, int offset, byte value )
+{
+   if( ! this->chr_writable ) {
+      return;
    }
+   byte *chr = &this->chr_ram[ bank * CHR_bank_size ];
+   byte *unpacked = &this->chr_unpacked[ bank * CHR_UNPACKED_bank_size ];
+   chr[offset] = value;
    
-   // 1 CHR-ROM bank = 2 CHR-ROM tables
-   assert( this->chr_rom_count == 1 ); // for now
-   this->chr_unpacked = (byte *) malloc( 2 * CHR_UNPACKED_size );
+   offset &= ~8; // Plane 0 of the row
+   uint64_t row = chr_spread[ chr[offset] ] | ( chr_spread[ chr[offset + 8] ] <<1 );
+   memcpy( &unpacked[ ( offset >>4 ) * 64 + ( offset & 7 ) * 8 ], &row, 8 );
+   this->chr_opaque[ bank * CHR_OPAQUE_bank_size + ( offset >>4 ) * 8 + ( offset & 7 ) ] = chr[offset] | chr[offset + 8];
    
-   byte *chr_rom_ptr[] = {
-      &this->chr_rom[0],
-      &this->chr_rom[0x1000]
-   };
-   
-   // Each pointer points to each of the 2 CHR-ROM tables, 0: sprites, 1: background
-   this->chr_unpacked_ptr[0] = &this->chr_unpacked[0];
-   this->chr_unpacked_ptr[1] = &this->chr_unpacked[CHR_UNPACKED_size];
-   
-   for( int chrom = 0; chrom <= 1; ++chrom )
-   {
-      byte *lsb = chr_rom_ptr[chrom];
-      byte *msb = lsb + 8;
-      byte *unpacked = this->chr_unpacked_ptr[chrom];
-      for( int tilen = 0; tilen < 0x100; ++tilen )
-      {
-         for( int line = 0; line <= 7; ++line )
-         {
-            for( int bit = 7; bit >= 0; --bit )
-            {
-               byte color_index = ( *lsb & (1<<bit) ) >>bit;
-               color_index |= ( ( *msb & (1<<bit) ) >>bit ) <<1 ;
-               
-               *unpacked = color_index;
-               assert( unpacked < &this->chr_unpacked[ CHR_UNPACKED_size*2 ] );
-               unpacked++;
-            }
-            ++lsb;
-            ++msb;
-         }
-         lsb += 8;
-         msb += 8;
+   for( int i = 0; i < 4; ++i ) { // Tiles of the pre-rendered background using the pattern, see Render.c
+      if( this->plane_chr[i] == unpacked ) {
+         int tile = ( i <<6 ) | ( offset >>4 );
+         this->pattern_dirty[ tile >>6 ] |= 1ull << ( tile & 63 );
+         this->patterns_dirty = true;
       }
    }
 }
 
+// -------------------------------------------------------------------------------
+// Point 8kB window [0..3] of CPU $8000..$FFFF at 8kB PRG bank `bank`, negative counts from the last bank
+void Nes_MapPrg( Nes *this, int window, int bank )
+{
+   int banks = this->prg_rom_count * PRG_ROM_bank_size / PRG_bank_size;
+   if( banks == 0 ) { // No ROM, a mapper write after Rom_Detach()
+      return;
+   }
+   bank %= banks;
+   if( bank < 0 ) {
+      bank += banks;
+   }
+   this->mapper.prg_bank[window] = bank;
+   int page = 0x80 + window * ( PRG_bank_size >>8 );
+   const byte *prg = &this->prg_rom[ bank * PRG_bank_size ];
+   map_pages( this, page, page + ( PRG_bank_size >>8 ) - 1, prg, PRG_bank_size );
+   this->prg_ptr[window] = prg;
+}
+
+// -------------------------------------------------------------------------------
+void Nes_SetMirroring( Nes *this, int mirroring )
+{
+   // Physical name table [0..3] seen through each of the 4 virtual ones
+   static const byte tables[5][4] = {
+      { 0, 1, 0, 1 }, // mirroring_vertical
+      { 0, 0, 1, 1 }, // mirroring_horizontal
+      { 0, 1, 2, 3 }, // mirroring_4screens
+      { 0, 0, 0, 0 }, // mirroring_single_lower
+      { 1, 1, 1, 1 }  // mirroring_single_upper
+   };
+   this->ppu.mirroring = mirroring;
+   for( int i = 0; i < 4; ++i ) {
+      this->name_ptr[i] = &this->ppu.name_attr[ tables[mirroring][i] * 0x400 ];
+      this->attr_ptr[i] = this->name_ptr[i] + 0x3C0;
+   }
+}
+
 // -------------------------------------------------------------------------------
 void Nes_Reset( Nes *this )
 {
@@ -166,178 +303,318 @@ void Nes_Reset( Nes *this )
 }
 
 // -------------------------------------------------------------------------------
-void check_sprite0hit( Nes *this );
-
-void Nes_DoFrame( Nes *this )
+// Bring the PPU up to the current cycle: work out the scan position and finish the scanlines left behind
+// (rendering them and clocking the mapper scanline counter). Called lazily, only when something about
+// to change affects rendering (PPU registers, bank switches) and at the frame events.
+void Nes_SyncPpu( Nes *this )
 {
-   int cpu_cycles = 0;
-   int vblank_started = 0;
-   while( 1 )
+   long frame_cycle = this->ppu_cycles - this->frame_start;
+   this->scanline  = (int)( frame_cycle / 341 ) - 1;
+   this->scanpixel = (int)( frame_cycle % 341 );
+   
+   int current = ( this->scanline < 261 ) ? this->scanline : 261;
+   while( this->next_line < current ) // Every line before the current one is complete
    {
-      if(( this->scanline == 241 ) && ( this->vblank == 0 ))
-      {
-         this->frames++;
-         this->ppu.vblank_flag = 1;
-         this->vblank = 1;
-         vblank_started = 1;
-         if( this->ppu.nmi_enabled )
-         {
-            cpu_cycles = Cpu6502_NMI( this->cpu );
+      int line = this->next_line++;
+      if(( line >= 0 ) && ( line < Nes_screen_height )) {
+         if( this->render_skip ) {
+            Render_SkipScanline( this, line );
          }
-      }
-      else
-      {
-         cpu_cycles = Cpu6502_CpuStep( this->cpu );
-      }
-      
-      this->cpu_cycles += cpu_cycles;
-      this->ppu_cycles += 3 * cpu_cycles;
-
-      this->last_scanpixel = this->scanpixel;
-      this->scanpixel += 3 * cpu_cycles;
-      
-      if( this->scanpixel >= 341 )
-      {
-         this->scanpixel -= 341;
-         this->scanline++;
-         
-         if( this->scanline >= 261 )
-         {
-            this->scanline = -1;
-            this->ppu.sprite0_hit = 0; // WIP this actually happens on scanpixel 1, but does it matter?
-            this->ppu.vblank_flag = 0; // WIP this may actually happen on next scanline (0)
-            this->vblank = 0;
+         else {
+            Nes_RenderScanline( this, line );
          }
       }
-      
-      if( vblank_started ) { // Reaching scanline 241
-         break;
-      }
-      
-      // if last rendered pixels lie inside the visible screen and collide with the sprite 0 area
-      if(( this->scanline > -1 ) && ( this->scanline < 240 ) && ( this->last_scanpixel < 256 ) // WIP this will change when scroll is implemented
-         && ( this->ppu.sprite0_hit == 0 )
-         && ( this->ppu.sprites[0] >= this->scanline - 8 ) && ( this->ppu.sprites[0] <= this->scanline )
-         && ( this->ppu.sprites[3] >= this->scanpixel - 8 ) && ( this->ppu.sprites[3] <= this->scanpixel ))
+      if(( line < Nes_screen_height ) && ( this->mapper_scanline != NULL )
+         && ( this->ppu.background_visible || this->ppu.sprites_visible ))
       {
-         check_sprite0hit( this );
+         this->mapper_scanline( this );
       }
    }
 }
 
-// http://wiki.nesdev.com/w/index.php/PPU_OAM
-void check_sprite0hit( Nes *this )
+// -------------------------------------------------------------------------------
+// Frame cycle of the next sprite 0 hit as things are now, -1 if there is none left this frame.
+// Only the lines sprite 0 covers are tested, from the current one on: a burst ends on the predicted cycle
+// and overshoots it by one instruction at most, so a hit is never left behind on an earlier line.
+// Writes that can move the hit end the CPU burst so this runs again.
+// http://wiki.nesdev.com/w/index.php/PPU_OAM#Sprite_zero_hits
+static long predict_sprite0hit( Nes *this, long frame_cycle )
 {
-   this->ppu.sprite0_hit = 1;
-   printf( "S0h %03d,%03d frame %03d\n", this->scanpixel, this->scanline, this->frames );
+   if( this->ppu.sprite0_hit || this->chr_unpacked == NULL
+      || ! this->ppu.background_visible || ! this->ppu.sprites_visible )
+   {
+      return -1;
+   }
+   int first = this->ppu.sprites[0] + 1; // Sprites show one line below their Y
+   int line = (int)( frame_cycle / 341 ) - 1; // -1 for the pre-render line
+   if( line < first ) {
+      line = first;
+   }
+   for( ; line < first + this->ppu.sprite_height && line < Nes_screen_height; ++line )
+   {
+      int x = Render_Sprite0Hit( this, line );
+      if( x >= 0 ) {
+         return ( line + 1 ) * 341 + x + 1; // Pixel x is output on cycle x + 1 of the line
+      }
+   }
+   return -1;
 }
 
 // -------------------------------------------------------------------------------
-int Nes_LoadRom( Nes *this, FILE *rom_file )
+// Handle every event due by the current cycle and schedule the next one. Returns 1 when vblank starts.
+static int run_events( Nes *this )
 {
-   if( this->prg_rom != NULL ) {
-      free( this->prg_rom );
-      this->prg_rom = NULL;
+   long frame_cycle = this->ppu_cycles - this->frame_start;
+   Nes_ForgetIdleLoop( this ); // Events change what idle loops read
+   
+   if( frame_cycle >= Frame_ppu_cycles ) // End of the pre-render line, wrap to scanline -1
+   {
+      Nes_SyncPpu( this );
+      this->frame_start += Frame_ppu_cycles;
+      frame_cycle -= Frame_ppu_cycles;
+      this->next_line = -1;
+      this->line_state_count = 0; // Lines still not rendered from the last frame are dropped
+      memset( this->line_state, 0xFF, sizeof this->line_state );
+      this->vram_write_count = 0;
+      this->ppu.sprite0_hit = 0; // WIP this actually happens on scanpixel 1, but does it matter?
+      this->ppu.sprites_lost = 0;
+      this->ppu.vblank_flag = 0; // WIP this may actually happen on next scanline (0)
+      this->vblank = 0;
    }
-   if( this->chr_rom != NULL ) {
-      free( this->chr_rom );
-      this->chr_rom = NULL;
+   
+   long sprite0 = predict_sprite0hit( this, frame_cycle );
+   if(( sprite0 >= 0 ) && ( frame_cycle >= sprite0 ))
+   {
+      Nes_SyncPpu( this );
+      this->ppu.sprite0_hit = 1;
+      sprite0 = -1;
    }
    
-   rewind( rom_file );
-   byte header[10];
-   fread( header, 10, 1, rom_file );
-         
-   int trainer = ( header[6] & (1<<2) ) > 0; 
-   int offset = 16 + ( trainer ? 512 : 0 ); // skip 16 bytes header + 512B trainer
+   if(( this->vblank == 0 ) && ( frame_cycle >= VBlank_ppu_cycles ))
+   {
+      Nes_SyncPpu( this ); // Render the rest of the visible lines
+      this->frames++;
+      this->ppu.vblank_flag = 1;
+      this->vblank = 1;
+      if( this->ppu.nmi_enabled )
+      {
+         int cpu_cycles = Cpu6502_NMI( this->cpu );
+         profile_nmi( this, cpu_cycles );
+         this->cpu_cycles += cpu_cycles;
+         this->ppu_cycles += 3 * cpu_cycles;
+      }
+      this->next_event = this->ppu_cycles; // Schedule again on the next call
+      return 1;
+   }
    
-   // Read PRG-ROM banks
-   this->prg_rom_count = (int) header[4];
-   this->prg_rom = (byte*) malloc( this->prg_rom_count * PRG_ROM_bank_size );
-   if( this->prg_rom == NULL ) {
-      goto Exception;
+   long next = this->vblank ? Frame_ppu_cycles : VBlank_ppu_cycles;
+   if(( sprite0 >= 0 ) && ( sprite0 < next ) && ( sprite0 > frame_cycle )) {
+      next = sprite0;
+   }
+   this->next_event = this->frame_start + next;
+   return 0;
+}
+
+// -------------------------------------------------------------------------------
+// Idle loops poll $2002 or RAM until an event changes what they read, the most common being
+//    wait: LDA $2002
+//          BPL wait
+// Nothing they read can change between events, and they write nothing, so once an iteration has run from
+// the state the one before left, every iteration up to the next event does exactly the same. Those are
+// skipped by moving the cycle counters on by whole iterations, which leaves the very state running them
+// would have. An iteration is measured on the core rather than counted from the opcodes.
+
+#define Idle_instructions 4 // Longest loop recognized, the branch back included
+
+// Reads RAM or $2002 at most and sets registers the same way every time it runs again
+static int idle_instruction( const Nes_Instruction *instruction )
+{
+   switch( instruction->opcode )
+   {
+      case 0xEA: // NOP
+      case 0xA9: case 0xA2: case 0xA0: case 0xC9: case 0xE0: case 0xC0: case 0x29: case 0x09: // LDA LDX LDY CMP CPX CPY AND ORA #
+      case 0xA5: case 0xA6: case 0xA4: case 0x24: case 0xC5: case 0xE4: case 0xC4: case 0x25: case 0x05: // Zero page, BIT too
+         return true;
+      case 0xAD: case 0xAE: case 0xAC: case 0x2C: case 0xCD: case 0xEC: case 0xCC: case 0x2D: case 0x0D: // Absolute
+         return ( instruction->operand < 0x2000 ) || ( ( instruction->operand & 0xE007 ) == 0x2002 );
    }
-   fseek( rom_file, offset, SEEK_SET );
-   size_t read_count = fread( this->prg_rom, PRG_ROM_bank_size, this->prg_rom_count, rom_file );
-   if( read_count != this->prg_rom_count ) {
-      goto Exception;
+   return false;
+}
+
+// CPU cycles of an iteration of the idle loop `head`..`tail` without page crossing, 0 if it isn't one
+static int idle_loop_period( Nes *this, word head, word tail, int *polls_status )
+{
+   *polls_status = false;
+   int period = 0;
+   for( int count = 0; count < Idle_instructions; ++count )
+   {
+      Nes_Instruction instruction;
+      if( ! Decode_Instruction( this, head, &instruction ) ) {
+         return 0;
+      }
+      period += instruction.cycles;
+      if( head == tail ) { // Conditional branches are taken, 1 cycle more
+         return ( instruction.mode == Decode_relative ) ? period + 1 : ( instruction.opcode == 0x4C ) ? period : 0;
+      }
+      if( ! idle_instruction( &instruction ) ) {
+         return 0;
+      }
+      if(( instruction.mode == Decode_absolute ) && ( instruction.operand >= 0x2000 )) {
+         *polls_status = true;
+      }
+      head += instruction.length;
    }
-   
-   // The CHR-ROM banks immediately follow the PRG-ROM banks, no fseek() needed
-   this->chr_rom_count = (int) header[5];
-   if( this->chr_rom_count == 0 ) {
-      this->chr_rom_count = 1; // WIP: CHR-ROM count of 0 means 1 as most docs say or does it mean it has only CHR-RAM?
+   return 0;
+}
+
+// PPU cycle the iterations skipped must end by. Besides events, sprite overflow changes what $2002 reads:
+// it is set when a line with more than 8 sprites is rendered, which a read does once the line is over.
+static long idle_skip_end( Nes *this )
+{
+   long end = this->next_event;
+   if( this->idle_polls_status && ! this->ppu.sprites_lost
+      && ( this->ppu.background_visible || this->ppu.sprites_visible ) )
+   {
+      int line = Render_NextOverflowLine( this, ( this->next_line > 0 ) ? this->next_line : 0 );
+      long overflow = this->frame_start + ( line + 2 ) * 341L; // Line done once the one after it starts
+      if(( line >= 0 ) && ( overflow < end )) {
+         end = overflow;
+      }
    }
-   this->chr_rom = (byte*) malloc( this->chr_rom_count * CHR_ROM_bank_size );
-   if( this->chr_rom == NULL ) {
-      goto Exception;
+   return end;
+}
+
+// The CPU just jumped back from `tail`. Skips the iterations left before the next event if that closed an
+// idle loop, after the iteration before was measured.
+static void skip_idle_loop( Nes *this, word tail )
+{
+   word head = this->cpu->pc;
+   uint32_t jump = (uint32_t) head <<16 | tail; // Both ends, loop heads are often jumped to from further on too
+   uint32_t *rejected = &this->idle_rejected[ head & 15 ];
+   if( head == this->idle_pc && tail == this->idle_tail )
+   {
+      long period = this->cpu_cycles - this->idle_cycles;
+      if(( this->idle_cycles >= 0 ) && ( period >= this->idle_period ) && ( period <= this->idle_period + 1 )) {
+         long iterations = ( idle_skip_end( this ) - this->ppu_cycles ) / ( 3 * period );
+         if( iterations < 0 ) { // An overflow line already over, the next read sets the flag
+            iterations = 0;
+         }
+         this->cpu_cycles += iterations * period;
+         this->ppu_cycles += iterations * 3 * period;
+         profile_cycles( this, iterations * period );
+      }
+      // else the code between the two jumps was more than the loop, measure again
    }
-   read_count = fread( this->chr_rom, CHR_ROM_bank_size, this->chr_rom_count, rom_file );
-   if( read_count != this->chr_rom_count ) {
-      goto Exception;
+   else if( jump == *rejected ) {
+      return;
    }
-   
-   Nes_UnpackChrRom( this );
-
-   if( header[5] & (1<<3) ) {
-      this->ppu.mirroring = mirroring_4screens;
-      assert( 0 && "4 screen [non]mirroring not implemented yet" );
-   }
-   else if( header[5] & 1 ) {
-      this->ppu.mirroring = mirroring_vertical;
-      this->ppu.name_ptr[0] = &this->ppu.name_attr[0];
-      this->ppu.name_ptr[1] = &this->ppu.name_attr[0x400];
-      this->ppu.name_ptr[2] = &this->ppu.name_attr[0];
-      this->ppu.name_ptr[3] = &this->ppu.name_attr[0x400];
-      
-      this->ppu.attr_ptr[0] = &this->ppu.name_attr[0x3C0];
-      this->ppu.attr_ptr[1] = &this->ppu.name_attr[0x7C0];
-      this->ppu.attr_ptr[2] = &this->ppu.name_attr[0x3C0];
-      this->ppu.attr_ptr[3] = &this->ppu.name_attr[0x7C0];
+   else if(( this->idle_period = idle_loop_period( this, head, tail, &this->idle_polls_status ) ) > 0 ) {
+      this->idle_pc = head;
+      this->idle_tail = tail;
    }
    else {
-      this->ppu.mirroring = mirroring_horizontal;
-      this->ppu.name_ptr[0] = &this->ppu.name_attr[0];
-      this->ppu.name_ptr[1] = &this->ppu.name_attr[0];
-      this->ppu.name_ptr[2] = &this->ppu.name_attr[0x400];
-      this->ppu.name_ptr[3] = &this->ppu.name_attr[0x400];
-      
-      this->ppu.attr_ptr[0] = &this->ppu.name_attr[0x3C0];
-      this->ppu.attr_ptr[1] = &this->ppu.name_attr[0x3C0];
-      this->ppu.attr_ptr[2] = &this->ppu.name_attr[0x7C0];
-      this->ppu.attr_ptr[3] = &this->ppu.name_attr[0x7C0];
+      *rejected = jump;
+      return;
    }
-   
-   // Extra check to trap any unseen error in reading the rom file
-   byte dummy;
-   size_t remaining = fread( &dummy, 1, 1, rom_file );   
-   if( ! feof( rom_file ) || ( remaining != 0 ) ) {
-      fprintf( stderr, "The rom file didn't end after CHR-ROM banks as expected.\n" );
+   // While vblank is set the next $2002 read differs, wait for the iteration after
+   this->idle_cycles = ( this->idle_polls_status && this->ppu.vblank_flag ) ? -1 : this->cpu_cycles;
+}
+
+// Drop what was learnt about the running code, called when the state changes other than by running it
+void Nes_ForgetIdleLoop( Nes *this )
+{
+   this->idle_pc = -1;
+   memset( this->idle_rejected, 0xFF, sizeof this->idle_rejected );
+}
+
+// On by default. Off, every instruction is run, e.g. to compare against.
+void Nes_SetIdleSkip( Nes *this, int skip )
+{
+   this->idle_skip = skip;
+   Nes_ForgetIdleLoop( this );
+}
+
+// -------------------------------------------------------------------------------
+// Run the CPU in bursts up to the next PPU event instead of checking the PPU after every instruction.
+// Register handlers that may change what comes next set next_event to the current cycle to end the burst.
+void Nes_DoFrame( Nes *this )
+{
+   if( this->movie != NULL ) {
+      Movie_BeginFrame( this );
    }
-      
-   return true;
+   while( 1 )
+   {
+      while( this->ppu_cycles < this->next_event )
+      {
+         word pc = this->cpu->pc;
+         profile_pc( this );
+         int cpu_cycles = Cpu6502_CpuStep( this->cpu );
+         profile_cycles( this, cpu_cycles );
+         this->instructions++;
+         this->cpu_cycles += cpu_cycles;
+         this->ppu_cycles += 3 * cpu_cycles;
+         if(( this->cpu->pc <= pc ) && this->idle_skip ) { // Jumped back, maybe closing an idle loop
+            skip_idle_loop( this, pc );
+         }
+      }
+      if( run_events( this ) ) { // Reaching scanline 241
+         break;
+      }
+   }
+   Nes_SyncApu( this ); // Hand the frame's audio to the output ring
    
-Exception:
+   if( this->movie != NULL ) {
+      Movie_EndFrame( this );
+   }
+   if( this->rewind != NULL ) {
+      Rewind_Capture( this );
+   }
+   if( this->render_thread != NULL ) {
+      RenderThread_EndFrame( this );
+   }
+   if( this->export != NULL ) {
+      Export_Frame( this );
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Reads the whole file, the image is private to this instance. See Nes_RomOpen() and Nes_AttachRom()
+// to share a ROM among instances.
+int Nes_LoadRom( Nes *this, FILE *rom_file )
+{
+   fseek( rom_file, 0, SEEK_END );
+   long size = ftell( rom_file );
+   rewind( rom_file );
+   if( size <= 0 ) {
+      return false;
+   }
+   byte *image = (byte*) malloc( size );
+   if( image == NULL ) {
+      return false;
+   }
+   if( fread( image, size, 1, rom_file ) != 1 ) {
+      free( image );
+      return false;
+   }
    
-   if( this->prg_rom != NULL ) {
-      free( this->prg_rom );
-      this->prg_rom = NULL;
-   }
-   if( this->chr_rom != NULL ) {
-      free( this->chr_rom );
-      this->chr_rom = NULL;
-   }  
-   return false;
+   Nes_Rom *rom = Nes_RomFromMemory( image, size, Rom_storage_malloc );
+   if( rom == NULL ) {
+      free( image );
+      return false;
+   }
+   int loaded = Nes_AttachRom( this, rom );
+   Nes_RomRelease( rom ); // The instance holds its own reference
+   return loaded;
 }
 
 // -------------------------------------------------------------------------------
 #ifdef _Cpu6502_Disassembler
    static byte read_memory_disasm( void *sys, word address )
    {
-      // For side effect reads, this should be avoided and direct access should be done instead.
-      // return ((Nes*)sys)->cpu->read_memory[address]( sys, address );
-      if( address < 0x2000 || address >= 0x8000 ) {
-         return ((Nes*)sys)->cpu->read_memory[address]( sys, address );
+      // Memory backed pages are read directly, I/O reads have side effects and must be avoided.
+      const byte *page = ((Nes*)sys)->read_page[ address >>8 ];
+      if( page != NULL ) {
+         return page[ address & 0xFF ];
       }
       else {
          return 0; // disasm.value should be overwritten by the register functions themselves
@@ -349,25 +626,36 @@ Exception:
 #include "MemoryAccess.h"
 
 byte read_ignore( void *sys, word address ) {
+   profile_read( (Nes*) sys, address );
    return 0;
 }
 void write_ignore( void *sys, word address, byte value ) {
+   profile_write( (Nes*) sys, address );
+}
+
+// Back CPU pages [first..last] with `size` bytes of host memory, repeated to fill the range as the NES mirrors do.
+// Only the page table is touched, so remapping (mirrors, bank switches) costs one pointer per page.
+static void map_pages( Nes *this, int first, int last, const byte *memory, int size )
+{
+   for( int page = first; page <= last; ++page ) {
+      this->read_page[page] = &memory[ ( ( page - first ) <<8 ) % size ];
+   }
 }
 
 static void init_builtin_memory_handlers( Nes *this )
 {
    int i;
+   memset( this->read_page,  0, sizeof this->read_page );
+   
 // RAM
-   for( i=0; i<=0x7FF; ++i ) {
+   for( i=0; i<=0x1FFF; ++i ) {
       this->cpu->read_memory[i]  = read_ram;
-      this->cpu->write_memory[i] = write_ram;      
-   }
-   for( i=0x800; i<=0x1FFF; ++i ) {
-      this->cpu->read_memory[i]  = read_ram_mirror;
-      this->cpu->write_memory[i] = write_ram_mirror;
+      this->cpu->write_memory[i] = write_ram;
    }
+   map_pages( this, 0x00, 0x1F, this->ram, 0x800 ); // $800..$1FFF mirror the 2kB
+   
    // Default all registers as unimplemented and then overwrite each one as they are implemented
-   for( i=0x2000; i<=0x7FFF; ++i ) {
+   for( i=0x2000; i<=0x5FFF; ++i ) {
       this->cpu->read_memory[i]  = read_unimplemented;
       this->cpu->write_memory[i] = write_unimplemented;
    }
@@ -406,9 +694,11 @@ static void init_builtin_memory_handlers( Nes *this )
    }
 // APU
    for( i = 0x4000; i <= 0x4020; ++i ) {
-      this->cpu->read_memory[i]  = read_ignore;
-      this->cpu->write_memory[i] = write_ignore;
+      this->cpu->read_memory[i]  = read_ignore; // WIP write only ports, should return open bus
+      this->cpu->write_memory[i] = ( i <= 0x4013 ) ? write_apu : write_ignore;
    }
+   this->cpu->read_memory[0x4015]  = read_apu_status;
+   this->cpu->write_memory[0x4015] = write_apu;
 // Sprite DMA
    this->cpu->read_memory[0x4014]  = read_unimplemented;
    this->cpu->write_memory[0x4014] = write_sprite_dma;
@@ -417,37 +707,43 @@ static void init_builtin_memory_handlers( Nes *this )
       this->cpu->read_memory[i]  = read_gamepad;
       this->cpu->write_memory[i] = write_gamepad;
    }
+   this->cpu->write_memory[0x4017] = write_apu; // Frame counter, reads are gamepad 2
 // Save RAM
    for( i=0x6000; i<=0x7FFF; ++i ) {
       this->cpu->read_memory[i]  = read_save_ram;
       this->cpu->write_memory[i] = write_save_ram;
    }
-// PRG ROM
+   map_pages( this, 0x60, 0x7F, this->save_ram, 0x2000 );
+   
+// PRG ROM, open bus until a ROM is attached
    for( i=0x8000; i<=0xFFFF; ++i ) {
-      this->cpu->read_memory[i]  = read_prg_rom;
+      this->cpu->read_memory[i]  = read_prg;
       this->cpu->write_memory[i] = write_ignore;
    }
+   Rom_UnmapPrg( this );
 }
 
 // -------------------------------------------------------------------------------
-// Returns palette 0, color 0 for any color index 0, even for sprite palettes
-// area 0 for background palettes, area 1 for sprite palettes
-const byte *Nes_GetPaletteColor( Nes *this, byte area, byte palette, byte index )
+void Nes_SetInputState( Nes *this, byte gamepad, byte button, byte state )
 {
-   byte rgb_index;
-   if( index == 0 ) {
-      rgb_index = this->ppu.palettes[0];
-   }
-   else {
-      rgb_index = this->ppu.palettes[ area * 0x10 + palette * 4 + index ];
+   this->input.gamepad[gamepad][button] = state;
+}
+
+// Set all the buttons of a gamepad at once, bit n of `state` is button n of enum Nes_Buttons
+void Nes_SetGamepad( Nes *this, byte gamepad, byte state )
+{
+   for( int button = Nes_A; button <= Nes_Right; ++button ) {
+      this->input.gamepad[gamepad][button] = ( state >> button ) & 1;
    }
-   return (const byte*) &Nes_rgb[rgb_index];
 }
 
-// -------------------------------------------------------------------------------
-void Nes_SetInputState( Nes *this, byte gamepad, byte button, byte state )
+byte Nes_GetGamepad( Nes *this, byte gamepad )
 {
-   this->input.gamepad[gamepad][button] = state;
+   byte state = 0;
+   for( int button = Nes_A; button <= Nes_Right; ++button ) {
+      state |= ( this->input.gamepad[gamepad][button] & 1 ) << button;
+   }
+   return state;
 }
 
 // -------------------------------------------------------------------------------
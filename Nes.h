@@ -2,20 +2,36 @@
    #define _Nes_h_
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include "Cpu6502.h"
+#include "Profile.h"
+#include "Apu.h"
 
 #define bit_value( _byte, bit_order ) ( ( _byte & ( 1 << bit_order ) ) >> bit_order )
 
 #define PRG_ROM_bank_size 0x4000 // PRG-ROM bank is 16kB
+#define PRG_bank_size     0x2000 // PRG is mapped in 8kB banks, the smallest any mapper switches
 #define CHR_ROM_bank_size 0x2000 // CHR-ROM bank is  8kB
-#define CHR_UNPACKED_size 0x100 * 8 * 8 // 0x100 tiles * 8 px tall * 8 px wide = 0x4000 bytes at 1 byte per pixel = 16Kb
-
-const byte nes_palette[64][3];
+#define CHR_bank_size     0x400  // CHR is mapped and unpacked in 1kB banks, the smallest any mapper switches
+#define CHR_banks_per_rom_bank  8
+#define CHR_UNPACKED_bank_size 0x40 * 8 * 8 // 0x40 tiles * 8 px tall * 8 px wide = 0x1000 bytes at 1 byte per pixel = 4kB
+#define CHR_OPAQUE_bank_size   0x40 * 8     // 0x40 tiles * 8 rows, 1 byte per row with a bit per opaque pixel
+#define Nes_screen_width  256
+#define Nes_screen_height 240
 
 enum {
    mirroring_vertical   = 0,
    mirroring_horizontal = 1,
-   mirroring_4screens   = 2
+   mirroring_4screens   = 2,
+   mirroring_single_lower = 3,
+   mirroring_single_upper = 4
+};
+
+enum Nes_Pixels {
+   Nes_pixels_rgba8888 = 0,
+   Nes_pixels_rgb565   = 1
 };
 
 enum Nes_Buttons {
@@ -36,28 +52,149 @@ enum Nes_Strobe {
    Nes_Strobe_init = 3
 };
 
+// Everything rendering a scanline depends on besides the contents of VRAM and OAM. Logged for each line
+// while rendering is skipped, so the lines can be rendered later as they would have been.
+typedef struct
+{
+   byte *chr_unpacked_ptr[8];
+   byte *name_ptr[4];
+   byte *attr_ptr[4];
+   word back_pattern;
+   word sprite_pattern;
+   byte sprite_height;
+   byte horz_scroll;
+   byte vert_scroll;
+   byte scroll_high_bits;
+   byte background_visible;
+   byte sprites_visible;
+   byte background_clip;
+   byte sprite_clip;
+} Nes_LineState;
+
+// What a logged VRAM write changed
+enum {
+   Log_name = 0, // Byte of ppu.name_attr
+   Log_oam  = 1, // Byte of ppu.sprites
+   Log_chr  = 2  // Byte of chr_ram
+};
+
+// A name table, OAM or CHR-RAM write made while lines wait to be rendered, see Render_LogWrite()
+typedef struct
+{
+   byte line;      // The write happened before this line was rendered
+   byte kind;      // Log_name, Log_oam or Log_chr
+   word address;
+   byte old_value;
+   byte value;
+} Nes_VramWrite;
+
 typedef struct // Nes
 {
    Cpu6502 *cpu;
    
-   byte *chr_rom; // Chunk with all CHR-ROM banks
+   // ROM data, immutable and shared with every instance running the same Nes_Rom
+   struct Nes_Rom *rom;
+   const byte *chr_rom; // Chunk with all CHR-ROM banks, or chr_ram below
    int chr_rom_count; // How many 8kB CHR-ROM banks are present
-   byte *chr_unpacked; // 1 byte per pixel translation of CHR-ROM
-   byte *chr_unpacked_ptr[2];
-   
-   byte *prg_rom; // Chunk with all PRG-ROM banks
+   int chr_writable; // The cartridge has CHR-RAM instead of CHR-ROM, pattern tables are writable
+   const byte *prg_rom; // Chunk with all PRG-ROM banks
    int prg_rom_count; // How many 16kB PRG-ROM banks are present
    
+   // Derived from the ROM and the emulation state, rebuilt after Nes_LoadState()
+   byte *chr_unpacked; // 1 byte per pixel translation of CHR, shared unless it is CHR-RAM
+   byte *chr_opaque; // Opacity mask of each tile row (plane 0 | plane 1, bit 7 is the leftmost pixel), unpacked along
+   atomic_uchar *chr_decoded; // State of each 1kB CHR bank: 0 packed, 1 being unpacked, 2 unpacked
+   const byte *chr_ptr[8]; // Packed bank mapped in each 1kB window of PPU $0000..$1FFF
+   byte *chr_unpacked_ptr[8]; // Unpacked bank mapped in each 1kB window of PPU $0000..$1FFF
+   byte *chr_opaque_ptr[8];   // Opacity masks of the bank mapped in each 1kB window
+   
+   // CPU memory map at 256 byte page granularity, for in-core reads (Nes_ReadMemory(), DMA, DMC). Pages
+   // backed by host memory (RAM, save RAM, PRG-ROM) point straight at it, I/O pages are NULL and go through
+   // the cpu->read_memory handlers. The CPU core itself only knows its 64K handler tables.
+   const byte *read_page[0x100];
+   const byte *prg_ptr[4]; // PRG bank mapped in each 8kB window of $8000..$FFFF, for read_prg()
+   
+   byte *name_ptr[4]; // pointers to the 4 virtual name tables in ppu.name_attr (2 real unless 4 screens)
+   byte *attr_ptr[4]; // pointers to the 4 virtual attribute tables (2 real)
+   
+   void (*mapper_scanline)( void *sys ); // Called at the end of each rendered scanline if the mapper counts them
+   
+   byte *framebuffer;   // 256x240 pixels, each one an index [$00..$1F] into ppu.palettes
+   byte *own_framebuffer; // Allocated with the instance, framebuffer may be the caller's, see Nes_SetFramebuffer()
+   byte sprite_lines[Nes_screen_height][8]; // First 8 sprites (OAM index) on each scanline, see Render.c
+   byte sprite_line_count[Nes_screen_height]; // Sprites on each scanline, over 8 means some were lost
+   int sprites_dirty; // OAM or the sprite height changed, sprite_lines must be rebuilt
+   byte *background_plane; // The 4 name tables of ppu.name_attr pre-rendered, 256x240 pixels each, see Render.c
+   byte *plane_chr[4]; // Background pattern banks background_plane was rendered with
+   uint32_t tile_dirty[4][30]; // Tiles of background_plane to render again, a bit per tile column of each row
+   uint64_t pattern_dirty[4]; // Background patterns rewritten in CHR-RAM, a bit per tile number
+   int patterns_dirty;
+   int background_dirty; // Name tables or background patterns replaced as a whole, all tiles are dirty
+   
+   unsigned long instructions; // Stepped by the CPU core, not counting idle loop iterations skipped
+   int idle_skip;       // Idle loops are fast-forwarded, see Nes.c
+   int idle_pc;         // First instruction of the idle loop being run, -1 if none
+   word idle_tail;      // Its branch or jump back
+   int idle_period;     // CPU cycles of one iteration at the least
+   int idle_polls_status; // The loop reads $2002
+   long idle_cycles;    // cpu_cycles when the loop came back to idle_pc, -1 if its next iteration can't be measured
+   uint32_t idle_rejected[16]; // Recent jumps back, head <<16 | tail, that aren't idle loops, hashed by head
+   
+   int render_skip; // Scanlines are not rendered while running but when the framebuffer is asked for
+   Nes_LineState line_states[Nes_screen_height]; // Distinct states the lines of this frame were left in
+   int line_state_count;
+   byte line_state[Nes_screen_height]; // Index into line_states of each line not rendered yet, 0xFF if rendered
+   struct Nes_RenderThread *render_thread; // Renders the logged lines on another thread, see RenderThread.c
+   int vram_logging; // Name table, OAM and CHR-RAM writes are logged, see Render_LogWrite()
+   Nes_VramWrite *vram_writes; // Logged since the lines waiting to be rendered ran, without a render thread
+   int vram_write_count;
+   int vram_write_capacity;
+   byte palette_rgba[4][0x20]; // ppu.palettes resolved to host colors, one plane per channel, see Palette.c
+   byte palette_rgb565[2][0x20]; // Low and high bytes
+   int palette_dirty; // ppu.palettes, emphasis or monochrome changed since they were resolved
+   struct Nes_Rewind *rewind; // Snapshot ring when rewinding is enabled, see Rewind.c
+   struct Nes_Audio *audio;   // Sample synthesis and output ring when audio is enabled, see Apu.c
+   struct Nes_Movie *movie;   // Movie being recorded or played back, see Movie.c
+   struct Nes_Export *export; // Writer of the frames run when exporting, see Export.c
+   int movie_mode;
+   int movie_frame;           // Next frame of the movie to record or play
+   int movie_mismatch;        // First frame whose RAM hash didn't match on playback, -1 if none
+   
+   #ifdef _Nes_Profile
+      Nes_Profile profile; // Counters for Nes_GetProfile(), see Profile.h
+   #endif
+   
+   // Emulation state: every field from `mapper` to the end of the struct. It holds no pointers, so the
+   // whole state is one contiguous block that Nes_SaveState() and Nes_LoadState() copy in one go.
+   struct
+   {
+      int id; // iNES mapper number
+      int prg_bank[4]; // 8kB PRG bank mapped in each window of $8000..$FFFF
+      int chr_bank[8]; // 1kB CHR bank mapped in each window of PPU $0000..$1FFF
+      byte reg[8]; // Bank and control registers, meaning depends on the mapper
+      byte bank_select;
+      byte shift; // MMC1 serial port
+      byte shift_count;
+      byte irq_latch; // MMC3 scanline counter
+      byte irq_counter;
+      byte irq_reload;
+      byte irq_enabled;
+      byte irq_pending;
+   } mapper;
+   
    byte ram[0x800]; // Built-in 2kB of RAM
    byte save_ram[0x2000]; // Battery backed RAM
-
-   int scanline;        // scanline number currently being rendered [-1..260]
-   int scanpixel;       // pixel number of current scanline being rendered [0..340]
-   int last_scanpixel;  // to compare the range of pixels rendered during last step
+   byte chr_ram[0x2000]; // Pattern tables of CHR-RAM cartridges
+   
+   int scanline;        // scanline number currently being rendered [-1..260], as of the last Nes_SyncPpu()
+   int scanpixel;       // pixel number of current scanline being rendered [0..340], idem
    int frames;          // frames rendered since reset
    int vblank;          // internal vblank flag that is not reset when read
    long cpu_cycles;     // CPU cycles executed since reset
    long ppu_cycles;     // PPU cycles executed since reset (3 PPU cycles per each CPU cycle)
+   long frame_start;    // ppu_cycles at the start of the current frame (scanline -1)
+   long next_event;     // ppu_cycles of the next PPU event, the CPU runs uninterrupted until then
+   int next_line;       // next scanline the PPU has to finish [-1..261], see Nes_SyncPpu()
    
    struct
    {
@@ -87,12 +224,11 @@ typedef struct // Nes
       byte vert_scroll;
       word vram_address; // VRAM address to read from or write to
       byte vram_latch;
+      byte oam_address;  // $2003
       
       byte mirroring;
-      byte *name_attr;   // Chunk of memory for 2 name tables and their attributes
-      byte *name_ptr[4]; // pointers to the 4 virtual name tables (2 real)
-      byte *attr_ptr[4]; // pointers to the 4 virtual attribute tables (2 real)
-      byte palettes[0x20]; // WIP should memory be malloc'ed? the Nes itself is malloc'ed anyway.
+      byte name_attr[0x1000]; // 4 name tables and their attributes, only 2 used unless 4 screens
+      byte palettes[0x20];
       byte sprites[0x100];
    } ppu;
    
@@ -102,6 +238,21 @@ typedef struct // Nes
       byte read_count[2];
    } input;
    
+   struct
+   {
+      Apu_Pulse pulse[2];
+      Apu_Triangle triangle;
+      Apu_Noise noise;
+      Apu_Dmc dmc;
+      byte enabled;        // $4015 channel enable bits
+      byte sequence_mode;  // $4017 frame counter: 0 = 4-step, 1 = 5-step
+      byte irq_inhibit;
+      byte frame_irq;
+      int sequence_step;   // Next frame counter event [0..3]
+      long sequence_start; // CPU cycle the current frame counter sequence started
+      long time;           // CPU cycle the APU has been run up to, see Nes_SyncApu()
+   } apu;
+   
 } Nes;
 
 Nes *Nes_Create();
@@ -109,10 +260,65 @@ void Nes_Reset( Nes *this );
 void Nes_Free( Nes *this );
 int  Nes_LoadRom( Nes *this, FILE *rom_file );
 void Nes_DoFrame( Nes *this );
+void Nes_SyncPpu( Nes *this );
+void Nes_SetIdleSkip( Nes *this, int skip );
+void Nes_ForgetIdleLoop( Nes *this );
+void Nes_SyncApu( Nes *this );
+void Apu_Reset( Nes *this );
 const byte *Nes_GetPaletteColor( Nes *this, byte area, byte palette, byte index );
+void Nes_MapChr( Nes *this, int window, int bank );
+void Nes_MapPrg( Nes *this, int window, int bank );
+void Nes_WriteChr( Nes *this, word address, byte value );
+void Nes_WriteChrBank( Nes *this, int bank, int offset, byte value );
+void Nes_SetMirroring( Nes *this, int mirroring );
+
+#define Nes_state_offset offsetof( Nes, mapper )
+#define Nes_state_size   ( sizeof( Nes ) - Nes_state_offset )
+
+size_t Nes_StateSize( Nes *this );
+size_t Nes_SaveState( Nes *this, void *buffer );
+int    Nes_LoadState( Nes *this, const void *buffer, size_t size );
+Nes *Nes_Clone( const Nes *source );
+void Nes_Release( Nes *this );
+int  Nes_WarmPool( const Nes *source, int count );
+void Nes_FreePool( void );
+void Nes_RenderScanline( Nes *this, int line );
+const byte *Nes_GetFramebuffer( Nes *this );
+void Nes_SetFramebuffer( Nes *this, byte *buffer );
+void Nes_SetRenderSkip( Nes *this, int skip );
+void Render_SkipScanline( Nes *this, int line );
+void Render_LoadLineState( Nes *this, const Nes_LineState *state );
+void Render_LogWrite( Nes *this, int kind, int address, byte value );
+int  Render_Sprite0Hit( Nes *this, int line );
+int  Render_NextOverflowLine( Nes *this, int line );
+void Render_NameChanged( Nes *this, int offset, byte changed );
+void Nes_ConvertFramebuffer( Nes *this, void *dest, int pitch, int format );
+void Palette_Resolve( Nes *this );
 
 void Nes_SetInputState( Nes *this, byte gampead, byte button, byte state );
+void Nes_SetGamepad( Nes *this, byte gamepad, byte state );
+byte Nes_GetGamepad( Nes *this, byte gamepad );
 
-const byte Nes_rgb[64][3];
+int    Nes_AudioEnable( Nes *this, int rate, size_t ring_samples );
+void   Nes_AudioDisable( Nes *this );
+size_t Nes_AudioRead( Nes *this, short *dest, size_t count );
+unsigned long Nes_AudioDropped( Nes *this );
+
+const Nes_Profile *Nes_GetProfile( Nes *this );
+void Nes_ResetProfile( Nes *this );
+void Nes_DumpProfile( Nes *this, FILE *out );
+
+extern const byte Nes_rgb[64][3];
+
+// -------------------------------------------------------------------------------
+// Fast path for in-core memory reads: a plain load for memory backed pages, the handler otherwise.
+static inline byte Nes_ReadMemory( Nes *this, word address )
+{
+   const byte *page = this->read_page[ address >>8 ];
+   if( page != NULL ) {
+      return page[ address & 0xFF ];
+   }
+   return this->cpu->read_memory[address]( this, address );
+}
 
 #endif // #ifndef _Nes_h_
\ No newline at end of file
@@ -0,0 +1,183 @@
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "Nes.h"
+#include "RenderThread.h"
+
+#ifdef __SSSE3__
+   #include <tmmintrin.h>
+#endif
+
+// Framebuffer pixels are indexes into ppu.palettes, turning them into host colors takes two lookups:
+// the 32 palette entries are resolved once into host colors, with emphasis and monochrome from $2001
+// applied, then each frame is a straight 32 entry table lookup per pixel. The resolved palette is only
+// rebuilt when palette_dirty is set by a palette write, a $2001 write that changes its bits, or a state load.
+
+// Nes_rgb with each of the 8 combinations of the $2001 emphasis bits applied
+static byte emphasized[8][64][3];
+static pthread_once_t emphasized_once = PTHREAD_ONCE_INIT;
+
+static void init_emphasized( void )
+{
+   for( int emphasis = 0; emphasis < 8; ++emphasis ) {
+      for( int color = 0; color < 64; ++color ) {
+         for( int channel = 0; channel < 3; ++channel ) {
+            // Emphasis bits are red, green, blue from bit 0 up. Setting any darkens the other channels.
+            int darken = emphasis != 0 && ! ( emphasis & ( 1 << channel ) );
+            emphasized[emphasis][color][channel] = darken ? Nes_rgb[color][channel] * 209 / 256 : Nes_rgb[color][channel];
+         }
+      }
+   }
+}
+
+static inline const byte *resolve_color( Nes *this, byte palette_entry )
+{
+   if( this->ppu.monochrome ) {
+      palette_entry &= 0x30; // Grey column of the same brightness
+   }
+   return emphasized[ this->ppu.color_emphasis ][ palette_entry & 0x3F ];
+}
+
+// -------------------------------------------------------------------------------
+static void pack_rgb565( const byte rgba[4][0x20], byte rgb565[2][0x20] )
+{
+   for( int i = 0; i < 0x20; ++i ) {
+      word color = ( ( rgba[0][i] >>3 ) <<11 ) | ( ( rgba[1][i] >>2 ) <<5 ) | ( rgba[2][i] >>3 );
+      rgb565[0][i] = color & 0xFF;
+      rgb565[1][i] = color >>8;
+   }
+}
+
+static void resolve_palette( Nes *this )
+{
+   pthread_once( &emphasized_once, init_emphasized );
+   for( int i = 0; i < 0x20; ++i )
+   {
+      // Transparent entries of every palette show the backdrop
+      const byte *rgb = resolve_color( this, this->ppu.palettes[ ( i & 3 ) ? i : 0 ] );
+      this->palette_rgba[0][i] = rgb[0];
+      this->palette_rgba[1][i] = rgb[1];
+      this->palette_rgba[2][i] = rgb[2];
+      this->palette_rgba[3][i] = 0xFF;
+   }
+   pack_rgb565( (const byte (*)[0x20]) this->palette_rgba, this->palette_rgb565 );
+   this->palette_dirty = false;
+}
+
+// Resolve the palette if it changed since it last was
+void Palette_Resolve( Nes *this )
+{
+   if( this->palette_dirty ) {
+      resolve_palette( this );
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Returns palette 0, color 0 for any color index 0, even for sprite palettes
+// area 0 for background palettes, area 1 for sprite palettes
+const byte *Nes_GetPaletteColor( Nes *this, byte area, byte palette, byte index )
+{
+   pthread_once( &emphasized_once, init_emphasized );
+   byte rgb_index;
+   if( index == 0 ) {
+      rgb_index = this->ppu.palettes[0];
+   }
+   else {
+      rgb_index = this->ppu.palettes[ area * 0x10 + palette * 4 + index ];
+   }
+   return resolve_color( this, rgb_index );
+}
+
+// -------------------------------------------------------------------------------
+#ifdef __SSSE3__
+// Look up 16 indexes [0..31] in a 32 byte table: two shuffles, picked by bit 4 of the index
+static inline __m128i lookup16( __m128i index, __m128i high, const byte *table )
+{
+   __m128i low_half  = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*) table ), index );
+   __m128i high_half = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*) ( table + 16 ) ), index );
+   return _mm_or_si128( _mm_andnot_si128( high, low_half ), _mm_and_si128( high, high_half ) );
+}
+#endif
+
+static void convert_line_rgba( const byte rgba[4][0x20], const byte *src, byte *dest )
+{
+   int x = 0;
+   #ifdef __SSSE3__
+      for( ; x < Nes_screen_width; x += 16 )
+      {
+         __m128i index = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &src[x] ), _mm_set1_epi8( 0x1F ) );
+         __m128i high = _mm_cmpgt_epi8( index, _mm_set1_epi8( 0x0F ) );
+         __m128i r = lookup16( index, high, rgba[0] );
+         __m128i g = lookup16( index, high, rgba[1] );
+         __m128i b = lookup16( index, high, rgba[2] );
+         __m128i a = _mm_set1_epi8( (char) 0xFF );
+         __m128i rg_low = _mm_unpacklo_epi8( r, g ), rg_high = _mm_unpackhi_epi8( r, g );
+         __m128i ba_low = _mm_unpacklo_epi8( b, a ), ba_high = _mm_unpackhi_epi8( b, a );
+         _mm_storeu_si128( (__m128i*) &dest[ x * 4 ],      _mm_unpacklo_epi16( rg_low, ba_low ) );
+         _mm_storeu_si128( (__m128i*) &dest[ x * 4 + 16 ], _mm_unpackhi_epi16( rg_low, ba_low ) );
+         _mm_storeu_si128( (__m128i*) &dest[ x * 4 + 32 ], _mm_unpacklo_epi16( rg_high, ba_high ) );
+         _mm_storeu_si128( (__m128i*) &dest[ x * 4 + 48 ], _mm_unpackhi_epi16( rg_high, ba_high ) );
+      }
+   #endif
+   for( ; x < Nes_screen_width; ++x ) {
+      byte i = src[x] & 0x1F;
+      dest[ x * 4 ]     = rgba[0][i];
+      dest[ x * 4 + 1 ] = rgba[1][i];
+      dest[ x * 4 + 2 ] = rgba[2][i];
+      dest[ x * 4 + 3 ] = 0xFF;
+   }
+}
+
+static void convert_line_rgb565( const byte rgb565[2][0x20], const byte *src, byte *dest )
+{
+   int x = 0;
+   #ifdef __SSSE3__
+      for( ; x < Nes_screen_width; x += 16 )
+      {
+         __m128i index = _mm_and_si128( _mm_loadu_si128( (const __m128i*) &src[x] ), _mm_set1_epi8( 0x1F ) );
+         __m128i high = _mm_cmpgt_epi8( index, _mm_set1_epi8( 0x0F ) );
+         __m128i low_byte  = lookup16( index, high, rgb565[0] );
+         __m128i high_byte = lookup16( index, high, rgb565[1] );
+         _mm_storeu_si128( (__m128i*) &dest[ x * 2 ],      _mm_unpacklo_epi8( low_byte, high_byte ) );
+         _mm_storeu_si128( (__m128i*) &dest[ x * 2 + 16 ], _mm_unpackhi_epi8( low_byte, high_byte ) );
+      }
+   #endif
+   for( ; x < Nes_screen_width; ++x ) {
+      byte i = src[x] & 0x1F;
+      dest[ x * 2 ]     = rgb565[0][i];
+      dest[ x * 2 + 1 ] = rgb565[1][i];
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Convert the whole framebuffer to host pixels in one pass, `pitch` is the bytes from one line of `dest`
+// to the next. RGBA8888 is 4 bytes per pixel in R, G, B, A memory order, RGB565 a little endian 16 bit word.
+// Colors come from the palette and $2001 as they were at the end of the frame shown, the last one run or,
+// with the render thread, the one before. Mid frame changes are not reflected.
+void Nes_ConvertFramebuffer( Nes *this, void *dest, int pitch, int format )
+{
+   const byte *src = Nes_GetFramebuffer( this );
+   const byte (*rgba)[0x20] = (const byte (*)[0x20]) this->palette_rgba;
+   const byte (*rgb565)[0x20] = (const byte (*)[0x20]) this->palette_rgb565;
+   byte frame_rgb565[2][0x20];
+   if( this->render_thread != NULL ) {
+      rgba = (const byte (*)[0x20]) RenderThread_Palette( this );
+      if( format == Nes_pixels_rgb565 ) {
+         pack_rgb565( rgba, frame_rgb565 );
+         rgb565 = (const byte (*)[0x20]) frame_rgb565;
+      }
+   }
+   else {
+      Palette_Resolve( this );
+   }
+   for( int line = 0; line < Nes_screen_height; ++line )
+   {
+      byte *dest_line = (byte*) dest + (size_t) line * pitch;
+      if( format == Nes_pixels_rgb565 ) {
+         convert_line_rgb565( rgb565, &src[ line * Nes_screen_width ], dest_line );
+      }
+      else {
+         convert_line_rgba( rgba, &src[ line * Nes_screen_width ], dest_line );
+      }
+   }
+}
@@ -0,0 +1,51 @@
+#include <string.h>
+#include "Nes.h"
+
+// -------------------------------------------------------------------------------
+// NULL unless built with _Nes_Profile
+const Nes_Profile *Nes_GetProfile( Nes *this )
+{
+   #ifdef _Nes_Profile
+      return &this->profile;
+   #else
+      return NULL;
+   #endif
+}
+
+// -------------------------------------------------------------------------------
+void Nes_ResetProfile( Nes *this )
+{
+   #ifdef _Nes_Profile
+      memset( &this->profile, 0, sizeof this->profile );
+   #endif
+}
+
+// -------------------------------------------------------------------------------
+// One counter per line, zero counters are left out:
+//    register $2002 reads 1234 writes 0
+//    page $C0 reads 10 writes 0 cycles 123456
+//    nmi cycles 420
+//    dma transfers 60 stall_cycles 30780
+void Nes_DumpProfile( Nes *this, FILE *out )
+{
+   const Nes_Profile *profile = Nes_GetProfile( this );
+   if( profile == NULL ) {
+      fprintf( out, "# profiling not compiled in, define _Nes_Profile\n" );
+      return;
+   }
+   fprintf( out, "# frames %d cpu_cycles %ld\n", this->frames, this->cpu_cycles );
+   for( int i = 0; i < Profile_registers; ++i ) {
+      if( profile->register_reads[i] || profile->register_writes[i] ) {
+         fprintf( out, "register $%04X reads %lu writes %lu\n", ( i < 8 ) ? 0x2000 + i : 0x4000 + i - 8,
+            profile->register_reads[i], profile->register_writes[i] );
+      }
+   }
+   for( int page = 0; page < 0x100; ++page ) {
+      if( profile->page_reads[page] || profile->page_writes[page] || profile->pc_cycles[page] ) {
+         fprintf( out, "page $%02X reads %lu writes %lu cycles %lu\n", page,
+            profile->page_reads[page], profile->page_writes[page], profile->pc_cycles[page] );
+      }
+   }
+   fprintf( out, "nmi cycles %lu\n", profile->nmi_cycles );
+   fprintf( out, "dma transfers %lu stall_cycles %lu\n", profile->dma_transfers, profile->dma_stall_cycles );
+}
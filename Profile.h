@@ -0,0 +1,46 @@
+#ifndef _Profile_h_
+   #define _Profile_h_
+
+#include "Cpu6502.h"
+
+// Instrumentation counters, only compiled in with _Nes_Profile defined. Otherwise the profile_* macros
+// expand to nothing and neither the handlers nor the CPU loop pay anything for them.
+typedef struct Nes_Profile
+{
+   unsigned long page_reads[0x100];   // Memory handler calls per CPU page, accesses the CPU core makes through its tables
+   unsigned long page_writes[0x100];
+   unsigned long register_reads[0x28]; // $2000..$2007 with their mirrors folded, then $4000..$401F
+   unsigned long register_writes[0x28];
+   unsigned long pc_cycles[0x100];    // CPU cycles spent on instructions fetched from each page
+   unsigned long nmi_cycles;
+   unsigned long dma_transfers;
+   unsigned long dma_stall_cycles;    // CPU cycles the CPU was halted by sprite DMA
+   word pc;                           // PC of the instruction being stepped
+} Nes_Profile;
+
+#define Profile_registers 0x28
+
+#ifdef _Nes_Profile
+   static inline void Profile_Access( unsigned long *pages, unsigned long *registers, word address )
+   {
+      pages[ address >>8 ]++;
+      if( address >= 0x2000 && address < 0x4020 ) {
+         registers[ ( address < 0x4000 ) ? ( address & 7 ) : 8 + ( address & 0x1F ) ]++;
+      }
+   }
+   #define profile_read( nes, address )  Profile_Access( (nes)->profile.page_reads, (nes)->profile.register_reads, address )
+   #define profile_write( nes, address ) Profile_Access( (nes)->profile.page_writes, (nes)->profile.register_writes, address )
+   #define profile_pc( nes )             ( (nes)->profile.pc = (nes)->cpu->pc )
+   #define profile_cycles( nes, cycles ) ( (nes)->profile.pc_cycles[ (nes)->profile.pc >>8 ] += (cycles) )
+   #define profile_nmi( nes, cycles )    ( (nes)->profile.nmi_cycles += (cycles) )
+   #define profile_dma( nes, cycles )    ( (nes)->profile.dma_transfers++, (nes)->profile.dma_stall_cycles += (cycles) )
+#else
+   #define profile_read( nes, address )
+   #define profile_write( nes, address )
+   #define profile_pc( nes )
+   #define profile_cycles( nes, cycles )
+   #define profile_nmi( nes, cycles )
+   #define profile_dma( nes, cycles )
+#endif
+
+#endif // #ifndef _Profile_h_
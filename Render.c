@@ -0,0 +1,531 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Nes.h"
+#include "RenderThread.h"
+
+#ifdef __SSE2__
+   #include <emmintrin.h>
+#endif
+
+// Each name table pre-rendered, 256x240 pixels
+#define Plane_size ( Nes_screen_width * Nes_screen_height )
+
+// -------------------------------------------------------------------------------
+// A tile row is 8 bytes of color indexes [0..3] in chr_unpacked. The output pixel is the index into
+// ppu.palettes: palette <<2 | color for opaque pixels, 0 (backdrop) for transparent ones.
+
+#ifdef __SSE2__
+// 16 pixels, 2 tile rows, at once
+static inline void render_tile_pair( byte *dest, const byte *row0, byte pal0, const byte *row1, byte pal1 )
+{
+   __m128i pixels = _mm_unpacklo_epi64( _mm_loadl_epi64( (const __m128i*) row0 ), _mm_loadl_epi64( (const __m128i*) row1 ) );
+   __m128i palette = _mm_unpacklo_epi64( _mm_set1_epi8( pal0 ), _mm_set1_epi8( pal1 ) );
+   __m128i opaque = _mm_cmpgt_epi8( pixels, _mm_setzero_si128() );
+   _mm_storeu_si128( (__m128i*) dest, _mm_or_si128( pixels, _mm_and_si128( palette, opaque ) ) );
+}
+#else
+// 8 pixels at once in a 64 bit register
+static inline void render_tile_row( byte *dest, const byte *row, byte pal )
+{
+   uint64_t pixels, palette;
+   memcpy( &pixels, row, 8 );
+   palette = pal * 0x0101010101010101ull;
+   uint64_t opaque = ( ( pixels | ( pixels >>1 ) ) & 0x0101010101010101ull ) * 0xFF; // 0xFF for each non zero pixel
+   pixels |= palette & opaque;
+   memcpy( dest, &pixels, 8 );
+}
+
+static inline void render_tile_pair( byte *dest, const byte *row0, byte pal0, const byte *row1, byte pal1 )
+{
+   render_tile_row( dest, row0, pal0 );
+   render_tile_row( dest + 8, row1, pal1 );
+}
+#endif
+
+// -------------------------------------------------------------------------------
+// Background plane: every name table is kept rendered in background_plane, and a scanline is a copy of
+// 256 pixels out of the planes of the 2 name tables it crosses. Name table writes dirty the tile they
+// change, or for attributes the tiles of the quadrants whose palette changed, CHR-RAM writes dirty the
+// tiles using the pattern, and only dirty tile rows are rendered again when a scanline needs them.
+// The planes hold palette indexes like the framebuffer, palette changes don't touch them.
+
+// Pattern and palette bits of the tile at ( column, row ) of a name table
+static inline const byte *fetch_tile( Nes *this, const byte *names, int column, int row, byte *palette )
+{
+   byte tile = names[ row * 32 + column ];
+   byte attr = names[ 0x3C0 + ( row >>2 ) * 8 + ( column >>2 ) ];
+   *palette = ( ( attr >> ( ( ( row & 2 ) <<1 ) | ( column & 2 ) ) ) & 3 ) <<2;
+   return &this->plane_chr[ tile >>6 ][ ( tile & 0x3F ) * 64 ];
+}
+
+// Render the dirty tiles of a tile row of name table [0..3] of ppu.name_attr, in pairs
+static void render_plane_row( Nes *this, int table, int row )
+{
+   uint32_t dirty = this->tile_dirty[table][row];
+   this->tile_dirty[table][row] = 0;
+   const byte *names = &this->ppu.name_attr[ table * 0x400 ];
+   byte *dest = &this->background_plane[ table * Plane_size + row * 8 * 256 ];
+   for( int column = 0; column < 32; column += 2 )
+   {
+      if( ( ( dirty >> column ) & 3 ) == 0 ) {
+         continue;
+      }
+      byte pal0, pal1;
+      const byte *tile0 = fetch_tile( this, names, column, row, &pal0 );
+      const byte *tile1 = fetch_tile( this, names, column + 1, row, &pal1 );
+      for( int y = 0; y < 8; ++y ) {
+         render_tile_pair( &dest[ y * 256 + column * 8 ], &tile0[ y * 8 ], pal0, &tile1[ y * 8 ], pal1 );
+      }
+   }
+}
+
+// Dirty the tiles that pattern table changes since the last scanline invalidate
+static void update_plane_patterns( Nes *this )
+{
+   byte **chr = &this->chr_unpacked_ptr[ this->ppu.back_pattern >>10 ];
+   if( this->background_dirty || memcmp( this->plane_chr, chr, sizeof this->plane_chr ) != 0 )
+   {
+      memcpy( this->plane_chr, chr, sizeof this->plane_chr );
+      memset( this->tile_dirty, 0xFF, sizeof this->tile_dirty );
+      memset( this->pattern_dirty, 0, sizeof this->pattern_dirty );
+      this->patterns_dirty = false;
+      this->background_dirty = false;
+   }
+   else if( this->patterns_dirty )
+   {
+      for( int table = 0; table < 4; ++table ) {
+         const byte *names = &this->ppu.name_attr[ table * 0x400 ];
+         for( int i = 0; i < 960; ++i ) {
+            if( ( this->pattern_dirty[ names[i] >>6 ] >> ( names[i] & 63 ) ) & 1 ) {
+               this->tile_dirty[table][ i >>5 ] |= 1u << ( i & 31 );
+            }
+         }
+      }
+      memset( this->pattern_dirty, 0, sizeof this->pattern_dirty );
+      this->patterns_dirty = false;
+   }
+}
+
+// Byte `offset` of ppu.name_attr is about to change by the `changed` bits
+void Render_NameChanged( Nes *this, int offset, byte changed )
+{
+   int table = offset >>10;
+   offset &= 0x3FF;
+   if( offset < 0x3C0 ) {
+      this->tile_dirty[table][ offset >>5 ] |= 1u << ( offset & 31 );
+      return;
+   }
+   offset -= 0x3C0;
+   for( int quadrant = 0; quadrant < 4; ++quadrant ) // 2x2 tiles each, top left, top right, bottom left, bottom right
+   {
+      if( changed & ( 3 << ( quadrant * 2 ) ) ) {
+         int row = ( offset >>3 ) * 4 + ( quadrant >>1 ) * 2;
+         uint32_t columns = 3u << ( ( offset & 7 ) * 4 + ( quadrant & 1 ) * 2 );
+         if( row < 30 ) { // The last attribute row covers only 2 tile rows
+            this->tile_dirty[table][row] |= columns;
+            this->tile_dirty[table][ row + 1 ] |= columns;
+         }
+      }
+   }
+}
+
+// -------------------------------------------------------------------------------
+static void render_background( Nes *this, int line, byte *dest )
+{
+   // Position of the scanline in the 512x480 virtual background made of the 4 name tables
+   int x = this->ppu.horz_scroll + ( ( this->ppu.scroll_high_bits & 1 ) <<8 );
+   int y = this->ppu.vert_scroll + ( this->ppu.scroll_high_bits >>1 ) * 240 + line;
+   y %= 480;
+   int left = ( ( y >= 240 ) <<1 ) | ( x >>8 ); // Virtual name table of the left part, the right one is next to it
+   if( y >= 240 ) {
+      y -= 240;
+   }
+   x &= 0xFF;
+
+   update_plane_patterns( this );
+   const byte *row[2];
+   for( int i = 0; i < 2; ++i )
+   {
+      int table = ( this->name_ptr[ left ^ i ] - this->ppu.name_attr ) >>10;
+      if( this->tile_dirty[table][ y >>3 ] ) {
+         render_plane_row( this, table, y >>3 );
+      }
+      row[i] = &this->background_plane[ table * Plane_size + y * 256 ];
+   }
+   memcpy( dest, row[0] + x, 256 - x );
+   memcpy( dest + 256 - x, row[1], x );
+
+   if( this->ppu.background_clip ) {
+      memset( dest, 0, 8 );
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Sort the 64 sprites into the scanlines they cover, keeping the first 8 of each line like the PPU
+// evaluation does. Only done when OAM or the sprite height changed since the last time.
+static void build_sprite_lines( Nes *this )
+{
+   memset( this->sprite_line_count, 0, sizeof this->sprite_line_count );
+   for( int sprite = 0; sprite < 64; ++sprite )
+   {
+      int first = this->ppu.sprites[ sprite * 4 ] + 1; // Sprites show one line below their Y
+      for( int line = first; line < first + this->ppu.sprite_height && line < Nes_screen_height; ++line ) {
+         if( this->sprite_line_count[line] < 8 ) {
+            this->sprite_lines[line][ this->sprite_line_count[line] ] = sprite;
+         }
+         this->sprite_line_count[line]++;
+      }
+   }
+   this->sprites_dirty = false;
+}
+
+// Pattern row of `sprite` on `line`, 8 bytes of color indexes [0..3]
+static inline const byte *fetch_sprite_row( Nes *this, const byte *sprite, int line )
+{
+   int height = this->ppu.sprite_height;
+   int row = line - ( sprite[0] + 1 );
+   if( sprite[2] & 0x80 ) { // Vertical flip
+      row = height - 1 - row;
+   }
+   int tile = sprite[1];
+   int pattern = this->ppu.sprite_pattern;
+   if( height == 16 ) { // 8x16 sprites pick their table with bit 0 and cover 2 tiles
+      pattern = ( tile & 1 ) ? 0x1000 : 0;
+      tile = ( tile & 0xFE ) + ( row >>3 );
+      row &= 7;
+   }
+   const byte *bank = this->chr_unpacked_ptr[ ( pattern >>10 ) + ( tile >>6 ) ];
+   return &bank[ ( tile & 0x3F ) * 64 + row * 8 ];
+}
+
+// Draw the sprites of a line over its background. The first opaque sprite pixel wins over the following
+// sprites, then its priority bit decides whether it goes in front of the background or behind it.
+static void render_sprites( Nes *this, int line, byte *dest )
+{
+   if( this->sprites_dirty ) {
+      build_sprite_lines( this );
+   }
+   int count = this->sprite_line_count[line];
+   if( count > 8 ) {
+      this->ppu.sprites_lost = 1; // WIP the hardware flag is buggy, this is the documented intent
+      count = 8;
+   }
+   if( ! this->ppu.sprites_visible || count == 0 ) {
+      return;
+   }
+
+   byte pixels[ 256 + 8 ]; // Sprite pixel of each x, 0 if none. Bit 7 is set for pixels behind the background.
+   memset( pixels, 0, sizeof pixels );
+   for( int i = 0; i < count; ++i )
+   {
+      const byte *sprite = &this->ppu.sprites[ this->sprite_lines[line][i] * 4 ];
+      const byte *row = fetch_sprite_row( this, sprite, line );
+      byte attributes = 0x10 | ( ( sprite[2] & 3 ) <<2 ) | ( ( sprite[2] & 0x20 ) <<2 );
+      int flip = ( sprite[2] & 0x40 ) ? 7 : 0;
+      byte *out = &pixels[ sprite[3] ];
+      for( int px = 0; px < 8; ++px ) {
+         byte color = row[ px ^ flip ];
+         if( color != 0 && out[px] == 0 ) {
+            out[px] = attributes | color;
+         }
+      }
+   }
+
+   for( int x = this->ppu.sprite_clip ? 8 : 0; x < 256; ++x ) {
+      byte pixel = pixels[x];
+      if( pixel != 0 && ( !( pixel & 0x80 ) || ( dest[x] & 3 ) == 0 ) ) {
+         dest[x] = pixel & 0x1F;
+      }
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Render one visible scanline [0..239] into the framebuffer
+void Nes_RenderScanline( Nes *this, int line )
+{
+   byte *dest = &this->framebuffer[ line * 256 ];
+   if( this->chr_unpacked == NULL ) {
+      memset( dest, 0, 256 );
+      return;
+   }
+
+   if( this->ppu.background_visible ) {
+      render_background( this, line, dest );
+   }
+   else {
+      memset( dest, 0, 256 );
+   }
+   if( this->ppu.background_visible || this->ppu.sprites_visible ) {
+      render_sprites( this, line, dest );
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Render skipping: instead of rendering, SyncPpu logs the state each line was left in and keeps up only
+// what the CPU can see, sprite overflow (sprite 0 hits are predicted apart from rendering anyway). The lines
+// are rendered with their logged state when the framebuffer is asked for. Writes to the name tables, OAM and
+// CHR-RAM are logged too, with their old values: rendering first undoes them back to the start of the frame,
+// then redoes each one before the line it preceded, so later writes don't show in earlier lines. The render
+// thread keeps a log of its own, see RenderThread.c.
+
+static void save_line_state( Nes *this, Nes_LineState *state )
+{
+   memset( state, 0, sizeof *state ); // Padding too, states are compared with memcmp
+   memcpy( state->chr_unpacked_ptr, this->chr_unpacked_ptr, sizeof state->chr_unpacked_ptr );
+   memcpy( state->name_ptr, this->name_ptr, sizeof state->name_ptr );
+   memcpy( state->attr_ptr, this->attr_ptr, sizeof state->attr_ptr );
+   state->back_pattern       = this->ppu.back_pattern;
+   state->sprite_pattern     = this->ppu.sprite_pattern;
+   state->sprite_height      = this->ppu.sprite_height;
+   state->horz_scroll        = this->ppu.horz_scroll;
+   state->vert_scroll        = this->ppu.vert_scroll;
+   state->scroll_high_bits   = this->ppu.scroll_high_bits;
+   state->background_visible = this->ppu.background_visible;
+   state->sprites_visible    = this->ppu.sprites_visible;
+   state->background_clip    = this->ppu.background_clip;
+   state->sprite_clip        = this->ppu.sprite_clip;
+}
+
+void Render_LoadLineState( Nes *this, const Nes_LineState *state )
+{
+   memcpy( this->chr_unpacked_ptr, state->chr_unpacked_ptr, sizeof state->chr_unpacked_ptr );
+   memcpy( this->name_ptr, state->name_ptr, sizeof state->name_ptr );
+   memcpy( this->attr_ptr, state->attr_ptr, sizeof state->attr_ptr );
+   if( this->ppu.sprite_height != state->sprite_height ) {
+      this->sprites_dirty = true;
+   }
+   this->ppu.back_pattern       = state->back_pattern;
+   this->ppu.sprite_pattern     = state->sprite_pattern;
+   this->ppu.sprite_height      = state->sprite_height;
+   this->ppu.horz_scroll        = state->horz_scroll;
+   this->ppu.vert_scroll        = state->vert_scroll;
+   this->ppu.scroll_high_bits   = state->scroll_high_bits;
+   this->ppu.background_visible = state->background_visible;
+   this->ppu.sprites_visible    = state->sprites_visible;
+   this->ppu.background_clip    = state->background_clip;
+   this->ppu.sprite_clip        = state->sprite_clip;
+}
+
+// Called by the write handlers while vram_logging, before writing `value` at `address` of the `kind` memory
+void Render_LogWrite( Nes *this, int kind, int address, byte value )
+{
+   if( this->render_thread != NULL ) {
+      RenderThread_LogWrite( this, kind, address, value );
+      return;
+   }
+   if( this->vram_write_count == this->vram_write_capacity )
+   {
+      int capacity = this->vram_write_capacity ? this->vram_write_capacity * 2 : 1024;
+      Nes_VramWrite *writes = (Nes_VramWrite*) realloc( this->vram_writes, capacity * sizeof( Nes_VramWrite ) );
+      if( writes == NULL ) { // The waiting lines will show memory as it is when rendered, like before logging
+         this->vram_write_count = 0;
+         this->vram_logging = false;
+         return;
+      }
+      this->vram_writes = writes;
+      this->vram_write_capacity = capacity;
+   }
+   Nes_VramWrite *entry = &this->vram_writes[ this->vram_write_count++ ];
+   entry->line = (byte)( this->next_line > 0 ? this->next_line : 0 );
+   entry->kind = (byte) kind;
+   entry->address = (word) address;
+   entry->old_value = ( kind == Log_name ) ? this->ppu.name_attr[address]
+                    : ( kind == Log_oam )  ? this->ppu.sprites[address] : this->chr_ram[address];
+   entry->value = value;
+}
+
+static void replay_write( Nes *this, const Nes_VramWrite *entry, byte value )
+{
+   switch( entry->kind )
+   {
+      case Log_name: {
+         byte *name = &this->ppu.name_attr[ entry->address ];
+         if( *name != value ) {
+            Render_NameChanged( this, entry->address, *name ^ value );
+            *name = value;
+         }
+         break;
+      }
+      case Log_oam:
+         this->ppu.sprites[ entry->address ] = value;
+         this->sprites_dirty = true;
+         break;
+      case Log_chr:
+         Nes_WriteChrBank( this, entry->address / CHR_bank_size, entry->address % CHR_bank_size, value );
+         break;
+   }
+}
+
+// Stands for Nes_RenderScanline() while skipping
+void Render_SkipScanline( Nes *this, int line )
+{
+   Nes_LineState state;
+   save_line_state( this, &state );
+   int last = this->line_state_count - 1;
+   if( last < 0 || memcmp( &state, &this->line_states[last], sizeof state ) != 0 ) {
+      this->line_states[ ++last ] = state; // At most one new state per line, it can't overflow
+      this->line_state_count = last + 1;
+   }
+   this->line_state[line] = last;
+   if( this->render_thread != NULL ) { // VRAM is logged from line 0 on, see RenderThread.c
+      if( line == 0 ) {
+         RenderThread_BeginFrame( this );
+      }
+      else if( line == Nes_screen_height - 1 ) {
+         this->vram_logging = false; // Later writes show in the next frame's snapshot
+      }
+   }
+
+   if( this->ppu.background_visible || this->ppu.sprites_visible ) {
+      if( this->sprites_dirty ) {
+         build_sprite_lines( this );
+      }
+      if( this->sprite_line_count[line] > 8 ) {
+         this->ppu.sprites_lost = 1;
+      }
+   }
+}
+
+static void render_skipped_lines( Nes *this )
+{
+   Nes_LineState current;
+   save_line_state( this, &current );
+   byte sprites_lost = this->ppu.sprites_lost; // Already up to date, rendering must not touch it
+   const Nes_VramWrite *writes = this->vram_writes;
+   int count = this->vram_write_count, write = 0;
+   for( int i = count - 1; i >= 0; --i ) { // Back to memory as the first waiting line saw it
+      replay_write( this, &writes[i], writes[i].old_value );
+   }
+   for( int line = 0; line < Nes_screen_height; ++line ) {
+      for( ; write < count && writes[write].line <= line; ++write ) {
+         replay_write( this, &writes[write], writes[write].value );
+      }
+      if( this->line_state[line] != 0xFF ) {
+         Render_LoadLineState( this, &this->line_states[ this->line_state[line] ] );
+         Nes_RenderScanline( this, line );
+         this->line_state[line] = 0xFF;
+      }
+   }
+   for( ; write < count; ++write ) {
+      replay_write( this, &writes[write], writes[write].value );
+   }
+   this->vram_write_count = 0;
+   if( this->render_thread == NULL ) {
+      this->vram_logging = ( this->render_skip != 0 ); // Back on if a failed allocation stopped it
+   }
+   Render_LoadLineState( this, &current );
+   this->ppu.sprites_lost = sprites_lost;
+}
+
+// -------------------------------------------------------------------------------
+// With `skip` frames run without rendering, several times faster, and every bit of CPU visible state stays
+// the same. The framebuffer is rendered when Nes_GetFramebuffer() is called.
+void Nes_SetRenderSkip( Nes *this, int skip )
+{
+   if( ! skip ) {
+      render_skipped_lines( this );
+   }
+   this->render_skip = skip;
+   if( this->render_thread == NULL ) { // The render thread logs from line 0 on its own
+      this->vram_logging = ( skip != 0 );
+   }
+}
+
+// -------------------------------------------------------------------------------
+const byte *Nes_GetFramebuffer( Nes *this )
+{
+   if( this->render_thread != NULL ) {
+      return RenderThread_Framebuffer( this );
+   }
+   if( this->render_skip ) {
+      render_skipped_lines( this );
+   }
+   return this->framebuffer;
+}
+
+// Render into `buffer`, Nes_screen_width * Nes_screen_height bytes the caller keeps alive, instead of
+// the instance's own framebuffer. Lets a host map the frames of many instances in one array without
+// copying them. NULL goes back to the own framebuffer. The new one is filled as lines are rendered.
+void Nes_SetFramebuffer( Nes *this, byte *buffer )
+{
+   this->framebuffer = ( buffer != NULL ) ? buffer : this->own_framebuffer;
+}
+
+// -------------------------------------------------------------------------------
+// Opacity mask of the 8 pixels of the tile row at ( x, y ) of the 512x480 virtual background, x a multiple of 8
+static inline byte fetch_opacity( Nes *this, int x, int y )
+{
+   int table = ( ( y >= 240 ) <<1 ) | ( x >>8 );
+   if( y >= 240 ) {
+      y -= 240;
+   }
+   byte tile = this->name_ptr[table][ ( y >>3 ) * 32 + ( ( x & 0xFF ) >>3 ) ];
+   const byte *bank = this->chr_opaque_ptr[ ( this->ppu.back_pattern >>10 ) + ( tile >>6 ) ];
+   return bank[ ( tile & 0x3F ) * 8 + ( y & 7 ) ];
+}
+
+static inline byte reverse_bits( byte b )
+{
+   b = ( b & 0xF0 ) >>4 | ( b & 0x0F ) <<4;
+   b = ( b & 0xCC ) >>2 | ( b & 0x33 ) <<2;
+   return ( b & 0xAA ) >>1 | ( b & 0x55 ) <<1;
+}
+
+// X of the first pixel where opaque sprite 0 and background pixels meet on visible scanline `line`, -1 if none.
+// One AND of the two opacity masks, bit 7 being the leftmost pixel.
+int Render_Sprite0Hit( Nes *this, int line )
+{
+   const byte *sprite = this->ppu.sprites;
+   int height = this->ppu.sprite_height;
+   int row = line - ( sprite[0] + 1 );
+   if( row < 0 || row >= height ) {
+      return -1;
+   }
+   if( sprite[2] & 0x80 ) { // Vertical flip
+      row = height - 1 - row;
+   }
+   int tile = sprite[1];
+   int pattern = this->ppu.sprite_pattern;
+   if( height == 16 ) { // 8x16 sprites pick their table with bit 0 and cover 2 tiles
+      pattern = ( tile & 1 ) ? 0x1000 : 0;
+      tile = ( tile & 0xFE ) + ( row >>3 );
+      row &= 7;
+   }
+   byte mask = this->chr_opaque_ptr[ ( pattern >>10 ) + ( tile >>6 ) ][ ( tile & 0x3F ) * 8 + row ];
+   if( sprite[2] & 0x40 ) { // Horizontal flip
+      mask = reverse_bits( mask );
+   }
+
+   // Background pixels under the sprite, across the 2 tiles it straddles
+   int x = sprite[3];
+   int bx = ( this->ppu.horz_scroll + ( ( this->ppu.scroll_high_bits & 1 ) <<8 ) + x ) & 0x1FF;
+   int by = ( this->ppu.vert_scroll + ( this->ppu.scroll_high_bits >>1 ) * 240 + line ) % 480;
+   unsigned background = fetch_opacity( this, bx & ~7, by ) <<8 | fetch_opacity( this, ( ( bx & ~7 ) + 8 ) & 0x1FF, by );
+   mask &= ( background << ( bx & 7 ) ) >>8;
+
+   if( x < 8 && ( this->ppu.background_clip || this->ppu.sprite_clip ) ) {
+      mask &= 0xFF >> ( 8 - x ); // Left 8 pixels hidden
+   }
+   if( x > 255 - 8 ) {
+      mask &= 0xFF << ( x - 247 ); // Never on pixel 255, nor past the right edge
+   }
+   if( mask == 0 ) {
+      return -1;
+   }
+   return x + __builtin_clz( mask ) - 24;
+}
+
+// First visible scanline from `line` on with more than 8 sprites, where rendering sets sprite overflow, -1 if none
+int Render_NextOverflowLine( Nes *this, int line )
+{
+   if( this->sprites_dirty ) {
+      build_sprite_lines( this );
+   }
+   for( ; line < Nes_screen_height; ++line ) {
+      if( this->sprite_line_count[line] > 8 ) {
+         return line;
+      }
+   }
+   return -1;
+}
@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "Nes.h"
+#include "Rom.h"
+#include "RenderThread.h"
+
+// Rendering on another thread, pipelined with the CPU: frame N is rasterized while frame N+1 runs.
+// The core runs with render skipping (see Render.c), so each line already leaves the state of the PPU
+// registers it was rendered with. What is still missing is memory, the name tables, OAM and CHR-RAM lines
+// are drawn from: when line 0 is reached they are copied into the frame's log, then every write to them
+// until line 239 is logged with the next line to render. The render thread replays the log on a shadow
+// instance attached to the same ROM, applying each write before the line it precedes, so lines come out
+// as if rendered inline, writes in the middle of the frame included.
+//
+// Two logs and two framebuffers alternate: the CPU fills one log while the other is rendered, and the
+// end of a frame waits for the render of the frame before it, if still going.
+
+typedef struct
+{
+   byte line;   // The write happened before this line was rendered
+   byte kind;   // Log_name, Log_oam or Log_chr
+   word address;
+   byte value;
+} Write_entry;
+
+// Most writes a frame can log, allocated up front: only lines 0..239 are logged, and the densest writes,
+// OAM DMA, take 2 CPU cycles each. A DMA started on the last line may run over it.
+#define Log_capacity ( Nes_screen_height * 341 / 3 / 2 + 256 )
+
+typedef struct
+{
+   int has_snapshot;
+   byte name_attr[0x1000];  // As of line 0
+   byte sprites[0x100];
+   byte chr_ram[0x2000];    // Only with CHR-RAM
+   Nes_LineState line_states[Nes_screen_height];
+   byte line_state[Nes_screen_height];
+   Write_entry *writes;     // In order, from line 0 to line 239, Log_capacity of them
+   int write_count;
+} Frame_log;
+
+struct Nes_RenderThread
+{
+   Nes *shadow;              // Renders the frames, attached to the same ROM
+   const byte *name_attr;    // Where the logged name table pointers point, ppu.name_attr of the instance
+   const byte *chr_unpacked; // Same for the CHR pointers of CHR-RAM, NULL for CHR-ROM which is shared
+   int render_skip;          // Render skipping as it was before starting
+
+   pthread_mutex_t lock;
+   pthread_cond_t ready;     // a frame was submitted or stopping
+   pthread_cond_t done;      // a frame was rendered
+   pthread_t thread;
+   Frame_log logs[2];        // Frame N is logged in logs[ N & 1 ]
+   byte *framebuffers[2];    // and rendered into framebuffers[ N & 1 ]
+   byte palettes[2][4][0x20]; // with palette_rgba as resolved at its end
+   long submitted;           // Frames logged so far
+   long rendered;            // Frames rendered so far
+   int quit;
+};
+
+// -------------------------------------------------------------------------------
+static void snapshot( Nes *this, Frame_log *log )
+{
+   memcpy( log->name_attr, this->ppu.name_attr, sizeof log->name_attr );
+   memcpy( log->sprites, this->ppu.sprites, sizeof log->sprites );
+   if( this->chr_writable ) {
+      memcpy( log->chr_ram, this->chr_ram, sizeof log->chr_ram );
+   }
+   log->has_snapshot = true;
+}
+
+// Line 0 is being rendered, called from Render_SkipScanline()
+void RenderThread_BeginFrame( Nes *this )
+{
+   struct Nes_RenderThread *rt = this->render_thread;
+   snapshot( this, &rt->logs[ rt->submitted & 1 ] );
+   this->vram_logging = true;
+}
+
+void RenderThread_LogWrite( Nes *this, int kind, int address, byte value )
+{
+   struct Nes_RenderThread *rt = this->render_thread;
+   Frame_log *log = &rt->logs[ rt->submitted & 1 ];
+   if( log->write_count == Log_capacity ) { // Can't happen, see Log_capacity
+      return;
+   }
+   Write_entry *entry = &log->writes[ log->write_count++ ];
+   entry->line = (byte) this->next_line;
+   entry->kind = (byte) kind;
+   entry->address = (word) address;
+   entry->value = value;
+}
+
+// End of the frame, called from Nes_DoFrame(). Hands the frame's log to the render thread.
+void RenderThread_EndFrame( Nes *this )
+{
+   struct Nes_RenderThread *rt = this->render_thread;
+   Frame_log *log = &rt->logs[ rt->submitted & 1 ];
+   this->vram_logging = false;
+   if( ! log->has_snapshot ) { // Started after line 0, or it was never reached
+      snapshot( this, log );
+   }
+   memcpy( log->line_states, this->line_states, this->line_state_count * sizeof( Nes_LineState ) );
+   memcpy( log->line_state, this->line_state, sizeof log->line_state );
+   Palette_Resolve( this );
+   memcpy( rt->palettes[ rt->submitted & 1 ], this->palette_rgba, sizeof rt->palettes[0] );
+   this->line_state_count = 0;
+   memset( this->line_state, 0xFF, sizeof this->line_state );
+
+   pthread_mutex_lock( &rt->lock );
+   rt->submitted++;
+   pthread_cond_signal( &rt->ready );
+   while( rt->rendered < rt->submitted - 1 ) { // The next log is the one of the frame before
+      pthread_cond_wait( &rt->done, &rt->lock );
+   }
+   pthread_mutex_unlock( &rt->lock );
+
+   Frame_log *next = &rt->logs[ rt->submitted & 1 ];
+   next->has_snapshot = false;
+   next->write_count = 0;
+}
+
+// The frame before the last one run, blank until two frames have been
+const byte *RenderThread_Framebuffer( Nes *this )
+{
+   struct Nes_RenderThread *rt = this->render_thread;
+   pthread_mutex_lock( &rt->lock );
+   long frame = rt->submitted - 2;
+   while( rt->rendered <= frame ) {
+      pthread_cond_wait( &rt->done, &rt->lock );
+   }
+   pthread_mutex_unlock( &rt->lock );
+   return rt->framebuffers[ frame >= 0 ? frame & 1 : 1 ];
+}
+
+// Resolved colors the frame returned by RenderThread_Framebuffer() ended with, planes as in palette_rgba
+const byte *RenderThread_Palette( Nes *this )
+{
+   struct Nes_RenderThread *rt = this->render_thread;
+   long frame = rt->submitted - 2;
+   return &rt->palettes[ frame >= 0 ? frame & 1 : 1 ][0][0];
+}
+
+// -------------------------------------------------------------------------------
+// Render thread side, everything happens on the shadow instance
+
+static void write_chr( Nes *shadow, int offset, byte value )
+{
+   if( shadow->chr_ram[offset] != value ) {
+      Nes_MapChr( shadow, 0, offset / CHR_bank_size ); // The line states map the windows for rendering
+      Nes_WriteChr( shadow, offset & ( CHR_bank_size - 1 ), value );
+   }
+}
+
+static void write_name( Nes *shadow, int offset, byte value )
+{
+   byte *entry = &shadow->ppu.name_attr[offset];
+   if( *entry != value ) {
+      Render_NameChanged( shadow, offset, *entry ^ value );
+      *entry = value;
+   }
+}
+
+static void apply_snapshot( struct Nes_RenderThread *rt, const Frame_log *log )
+{
+   Nes *shadow = rt->shadow;
+   if( memcmp( shadow->ppu.name_attr, log->name_attr, sizeof log->name_attr ) != 0 ) {
+      for( int i = 0; i < (int) sizeof log->name_attr; ++i ) {
+         write_name( shadow, i, log->name_attr[i] );
+      }
+   }
+   if( memcmp( shadow->ppu.sprites, log->sprites, sizeof log->sprites ) != 0 ) {
+      memcpy( shadow->ppu.sprites, log->sprites, sizeof log->sprites );
+      shadow->sprites_dirty = true;
+   }
+   if( rt->chr_unpacked != NULL && memcmp( shadow->chr_ram, log->chr_ram, sizeof log->chr_ram ) != 0 ) {
+      for( int i = 0; i < (int) sizeof log->chr_ram; ++i ) {
+         write_chr( shadow, i, log->chr_ram[i] );
+      }
+   }
+}
+
+static void apply_write( Nes *shadow, const Write_entry *entry )
+{
+   switch( entry->kind )
+   {
+      case Log_name:
+         write_name( shadow, entry->address, entry->value );
+         break;
+      case Log_oam:
+         shadow->ppu.sprites[ entry->address ] = entry->value;
+         shadow->sprites_dirty = true;
+         break;
+      case Log_chr:
+         write_chr( shadow, entry->address, entry->value );
+         break;
+   }
+}
+
+// Point the logged memory pointers of a line state at the shadow's memory
+static void rebase_line_state( struct Nes_RenderThread *rt, Nes_LineState *state )
+{
+   Nes *shadow = rt->shadow;
+   for( int i = 0; i < 4; ++i ) {
+      state->name_ptr[i] = shadow->ppu.name_attr + ( state->name_ptr[i] - rt->name_attr );
+      state->attr_ptr[i] = shadow->ppu.name_attr + ( state->attr_ptr[i] - rt->name_attr );
+   }
+   if( rt->chr_unpacked != NULL ) {
+      for( int i = 0; i < 8; ++i ) {
+         state->chr_unpacked_ptr[i] = shadow->chr_unpacked + ( state->chr_unpacked_ptr[i] - rt->chr_unpacked );
+      }
+   }
+}
+
+static void render_log( struct Nes_RenderThread *rt, const Frame_log *log, byte *framebuffer )
+{
+   Nes *shadow = rt->shadow;
+   Nes_SetFramebuffer( shadow, framebuffer );
+   if( log->has_snapshot ) {
+      apply_snapshot( rt, log );
+   }
+   int write = 0;
+   for( int line = 0; line < Nes_screen_height; ++line )
+   {
+      for( ; write < log->write_count && log->writes[write].line <= line; ++write ) {
+         apply_write( shadow, &log->writes[write] );
+      }
+      if( log->line_state[line] != 0xFF ) {
+         Nes_LineState state = log->line_states[ log->line_state[line] ];
+         rebase_line_state( rt, &state );
+         Render_LoadLineState( shadow, &state );
+         Nes_RenderScanline( shadow, line );
+      }
+   }
+   for( ; write < log->write_count; ++write ) {
+      apply_write( shadow, &log->writes[write] );
+   }
+}
+
+static void *render_main( void *arg )
+{
+   struct Nes_RenderThread *rt = (struct Nes_RenderThread*) arg;
+   pthread_mutex_lock( &rt->lock );
+   while( 1 )
+   {
+      while( rt->rendered == rt->submitted && ! rt->quit ) {
+         pthread_cond_wait( &rt->ready, &rt->lock );
+      }
+      if( rt->rendered == rt->submitted ) { // Quitting with every frame rendered
+         break;
+      }
+      long frame = rt->rendered;
+      pthread_mutex_unlock( &rt->lock );
+      render_log( rt, &rt->logs[ frame & 1 ], rt->framebuffers[ frame & 1 ] );
+      pthread_mutex_lock( &rt->lock );
+      rt->rendered++;
+      pthread_cond_broadcast( &rt->done );
+   }
+   pthread_mutex_unlock( &rt->lock );
+   return NULL;
+}
+
+// -------------------------------------------------------------------------------
+static void free_render_thread( struct Nes_RenderThread *rt )
+{
+   if( rt->shadow != NULL ) {
+      Nes_Free( rt->shadow );
+   }
+   for( int i = 0; i < 2; ++i ) {
+      free( rt->logs[i].writes );
+      free( rt->framebuffers[i] );
+   }
+   free( rt );
+}
+
+// Render on a thread of its own from now on, while the CPU runs the next frame. Nes_GetFramebuffer() then
+// returns the frame before the last one run, one frame of latency for running both halves at once, and
+// Nes_SetFramebuffer() has no effect. Frames are run with render skipping on. Stopped when the ROM is
+// detached. Returns false if it couldn't start, the instance renders as before then.
+int Nes_RenderThreadStart( Nes *this )
+{
+   if( this->render_thread != NULL ) {
+      return true;
+   }
+   if( this->rom == NULL ) {
+      return false;
+   }
+   struct Nes_RenderThread *rt = (struct Nes_RenderThread*) calloc( 1, sizeof( struct Nes_RenderThread ) );
+   if( rt == NULL ) {
+      return false;
+   }
+   rt->shadow = Nes_Create();
+   for( int i = 0; i < 2; ++i ) {
+      rt->framebuffers[i] = (byte*) calloc( Nes_screen_width * Nes_screen_height, 1 );
+      rt->logs[i].writes = (Write_entry*) malloc( Log_capacity * sizeof( Write_entry ) );
+   }
+   if( rt->shadow == NULL || rt->framebuffers[0] == NULL || rt->framebuffers[1] == NULL
+      || rt->logs[0].writes == NULL || rt->logs[1].writes == NULL || ! Nes_AttachRom( rt->shadow, this->rom ) )
+   {
+      free_render_thread( rt );
+      return false;
+   }
+   rt->name_attr = this->ppu.name_attr;
+   rt->chr_unpacked = this->chr_writable ? this->chr_unpacked : NULL;
+   rt->render_skip = this->render_skip;
+
+   pthread_mutex_init( &rt->lock, NULL );
+   pthread_cond_init( &rt->ready, NULL );
+   pthread_cond_init( &rt->done, NULL );
+   if( pthread_create( &rt->thread, NULL, render_main, rt ) != 0 ) {
+      pthread_mutex_destroy( &rt->lock );
+      pthread_cond_destroy( &rt->ready );
+      pthread_cond_destroy( &rt->done );
+      free_render_thread( rt );
+      return false;
+   }
+   Nes_SetRenderSkip( this, true );
+   this->render_thread = rt;
+   this->vram_logging = false; // Until line 0, see RenderThread_BeginFrame()
+   this->vram_write_count = 0; // Lines still waiting show memory as of the end of the frame
+   return true;
+}
+
+// Renders the frames submitted so far, the framebuffer then holds the last one
+void Nes_RenderThreadStop( Nes *this )
+{
+   struct Nes_RenderThread *rt = this->render_thread;
+   if( rt == NULL ) {
+      return;
+   }
+   pthread_mutex_lock( &rt->lock );
+   rt->quit = true;
+   pthread_cond_signal( &rt->ready );
+   pthread_mutex_unlock( &rt->lock );
+   pthread_join( rt->thread, NULL );
+
+   if( rt->submitted > 0 ) {
+      memcpy( this->framebuffer, rt->framebuffers[ ( rt->submitted - 1 ) & 1 ], Nes_screen_width * Nes_screen_height );
+   }
+   this->render_thread = NULL;
+   this->vram_logging = false;
+   Nes_SetRenderSkip( this, rt->render_skip ); // Renders the lines of the frame being run if it was off
+
+   pthread_mutex_destroy( &rt->lock );
+   pthread_cond_destroy( &rt->ready );
+   pthread_cond_destroy( &rt->done );
+   free_render_thread( rt );
+}
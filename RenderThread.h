@@ -0,0 +1,15 @@
+#ifndef _RenderThread_h_
+   #define _RenderThread_h_
+
+#include "Nes.h"
+
+int  Nes_RenderThreadStart( Nes *this );
+void Nes_RenderThreadStop( Nes *this );
+
+void RenderThread_BeginFrame( Nes *this );
+void RenderThread_EndFrame( Nes *this );
+void RenderThread_LogWrite( Nes *this, int kind, int address, byte value );
+const byte *RenderThread_Framebuffer( Nes *this );
+const byte *RenderThread_Palette( Nes *this );
+
+#endif // #ifndef _RenderThread_h_
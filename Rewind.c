@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Nes.h"
+#include "Rewind.h"
+
+// Snapshots go into a ring of `budget` bytes. Most are deltas: the XOR of the state against the previous
+// snapshot, run length encoded as ( zero run, literal run, literal bytes ) groups with varint lengths.
+// From frame to frame only a few hundred bytes change, so a delta is tiny compared to the ~23kB state.
+// Every `keyframe_interval` snapshots a full state is stored instead, rewinding rebuilds the state from
+// the nearest keyframe forward. When the ring is full the oldest keyframe and its deltas are dropped.
+
+typedef struct
+{
+   size_t offset; // In the data ring
+   size_t size;
+   int key;       // Full state, otherwise a delta against the previous entry
+} Entry;
+
+struct Nes_Rewind
+{
+   byte *data;            // The ring of encoded snapshots
+   size_t capacity;
+   Entry *entries;        // Ring of entries, oldest at `first`
+   int max_entries;
+   int first;
+   int count;
+
+   size_t state_size;
+   byte *previous;        // State of the newest entry
+   byte *current;         // Scratch for the state being captured or rebuilt
+   byte *encoded;         // Scratch for the delta being encoded, worst case size
+
+   int interval;          // Capture every `interval` frames
+   int keyframe_interval; // Snapshots between keyframes
+   int frames;            // Frames since the last capture
+   int since_keyframe;    // Snapshots since the last keyframe
+};
+
+#define entry( rw, i ) ( &(rw)->entries[ ( (rw)->first + (i) ) % (rw)->max_entries ] )
+
+// -------------------------------------------------------------------------------
+static byte *put_varint( byte *out, size_t value )
+{
+   while( value >= 0x80 ) {
+      *out++ = (byte)( value | 0x80 );
+      value >>= 7;
+   }
+   *out++ = (byte) value;
+   return out;
+}
+
+static const byte *get_varint( const byte *in, size_t *value )
+{
+   *value = 0;
+   for( int shift = 0; ; shift += 7 ) {
+      byte b = *in++;
+      *value |= (size_t)( b & 0x7F ) << shift;
+      if( ! ( b & 0x80 ) ) {
+         return in;
+      }
+   }
+}
+
+// XOR `state` against `base` into zero/literal runs, returns the encoded size
+static size_t encode_delta( byte *out, const byte *state, const byte *base, size_t size )
+{
+   byte *start = out;
+   size_t i = 0;
+   while( i < size )
+   {
+      size_t zeros = i;
+      while( i + 8 <= size ) { // Skip unchanged bytes 8 at a time
+         uint64_t a, b;
+         memcpy( &a, &state[i], 8 );
+         memcpy( &b, &base[i], 8 );
+         if( a != b ) {
+            break;
+         }
+         i += 8;
+      }
+      while( i < size && state[i] == base[i] ) {
+         ++i;
+      }
+      zeros = i - zeros;
+
+      size_t literals = i;
+      while( i < size && state[i] != base[i] ) {
+         ++i;
+      }
+      literals = i - literals;
+
+      out = put_varint( out, zeros );
+      out = put_varint( out, literals );
+      for( size_t j = i - literals; j < i; ++j ) {
+         *out++ = state[j] ^ base[j];
+      }
+   }
+   return out - start;
+}
+
+static void apply_delta( byte *state, const byte *delta, size_t delta_size )
+{
+   const byte *end = delta + delta_size;
+   size_t i = 0, zeros, literals;
+   while( delta < end )
+   {
+      delta = get_varint( delta, &zeros );
+      delta = get_varint( delta, &literals );
+      i += zeros;
+      while( literals-- > 0 ) {
+         state[i++] ^= *delta++;
+      }
+   }
+}
+
+// -------------------------------------------------------------------------------
+static void drop_oldest( struct Nes_Rewind *rw )
+{
+   do { // Deltas are useless without their keyframe
+      rw->first = ( rw->first + 1 ) % rw->max_entries;
+      rw->count--;
+   } while( rw->count > 0 && ! entry( rw, 0 )->key );
+}
+
+// Find room for `size` bytes at the head of the ring, dropping old snapshots as needed. NULL if it can't fit.
+static byte *reserve( struct Nes_Rewind *rw, size_t size )
+{
+   if( size > rw->capacity ) {
+      return NULL;
+   }
+   if( rw->count == rw->max_entries ) {
+      drop_oldest( rw );
+   }
+   while( 1 )
+   {
+      if( rw->count == 0 ) {
+         return rw->data;
+      }
+      Entry *oldest = entry( rw, 0 );
+      Entry *newest = entry( rw, rw->count - 1 );
+      size_t head = newest->offset + newest->size;
+      if( newest->offset >= oldest->offset ) { // Not wrapped, free space at the end and at the start
+         if( head + size <= rw->capacity ) {
+            return &rw->data[head];
+         }
+         if( size <= oldest->offset ) {
+            return rw->data;
+         }
+      }
+      else if( head + size <= oldest->offset ) { // Wrapped, free space between newest and oldest
+         return &rw->data[head];
+      }
+      drop_oldest( rw );
+   }
+}
+
+// Returns false if the record wasn't stored: too big for the ring, or a delta whose room took the last keyframe
+static int push( struct Nes_Rewind *rw, const byte *record, size_t size, int key )
+{
+   byte *dest = reserve( rw, size );
+   if( dest == NULL || ( ! key && rw->count == 0 ) ) {
+      return false;
+   }
+   memcpy( dest, record, size );
+   Entry *e = &rw->entries[ ( rw->first + rw->count ) % rw->max_entries ];
+   e->offset = dest - rw->data;
+   e->size = size;
+   e->key = key;
+   rw->count++;
+   return true;
+}
+
+// -------------------------------------------------------------------------------
+// Called by Nes_DoFrame() at the end of every frame
+void Rewind_Capture( Nes *this )
+{
+   struct Nes_Rewind *rw = this->rewind;
+   if( ++rw->frames < rw->interval ) {
+      return;
+   }
+   rw->frames = 0;
+
+   Nes_SaveState( this, rw->current );
+
+   size_t size = 0;
+   int key = ( rw->count == 0 ) || ( rw->since_keyframe + 1 >= rw->keyframe_interval );
+   if( ! key ) {
+      size = encode_delta( rw->encoded, rw->current, rw->previous, rw->state_size );
+      key = ( size >= rw->state_size ); // Not worth it
+   }
+   int stored = ! key && push( rw, rw->encoded, size, false );
+   if( ! stored ) { // A keyframe, or the delta emptied the ring making room for itself
+      key = true;
+      stored = push( rw, rw->current, rw->state_size, true );
+   }
+   if( ! stored ) { // Bigger than the budget, `previous` stays the state of the newest entry
+      return;
+   }
+   rw->since_keyframe = key ? 0 : rw->since_keyframe + 1;
+
+   byte *swap = rw->previous;
+   rw->previous = rw->current;
+   rw->current = swap;
+}
+
+// -------------------------------------------------------------------------------
+// Go back `steps` snapshots from the newest one, which is dropped along with anything after the target.
+// Returns how many steps back it actually went, 0 if there is no older snapshot or it couldn't be loaded
+// (the ROM was swapped since it was taken), in which case the ring is left as it was.
+int Nes_Rewind( Nes *this, int steps )
+{
+   struct Nes_Rewind *rw = this->rewind;
+   if( rw == NULL || rw->count == 0 ) {
+      return 0;
+   }
+   if( steps > rw->count - 1 ) {
+      steps = rw->count - 1;
+   }
+   int target = rw->count - 1 - steps;
+
+   int key = target;
+   while( key > 0 && ! entry( rw, key )->key ) {
+      --key;
+   }
+   if( ! entry( rw, key )->key ) { // Can't happen, deltas are never stored without their keyframe
+      return 0;
+   }
+   memcpy( rw->current, &rw->data[ entry( rw, key )->offset ], rw->state_size );
+   for( int i = key + 1; i <= target; ++i ) {
+      apply_delta( rw->current, &rw->data[ entry( rw, i )->offset ], entry( rw, i )->size );
+   }
+   if( ! Nes_LoadState( this, rw->current, rw->state_size ) ) { // `current` is scratch, nothing else was touched
+      return 0;
+   }
+
+   rw->count = target + 1;
+   rw->since_keyframe = target - key;
+   rw->frames = 0;
+   byte *swap = rw->previous;
+   rw->previous = rw->current;
+   rw->current = swap;
+   return steps;
+}
+
+// -------------------------------------------------------------------------------
+// Keep a snapshot every `interval` frames in a ring of `budget` bytes, a full one every `keyframe_interval`.
+// Returns false if memory couldn't be allocated.
+int Nes_RewindEnable( Nes *this, size_t budget, int interval, int keyframe_interval )
+{
+   Nes_RewindDisable( this );
+
+   struct Nes_Rewind *rw = (struct Nes_Rewind*) calloc( 1, sizeof( struct Nes_Rewind ) );
+   if( rw == NULL ) {
+      return false;
+   }
+   rw->state_size = Nes_StateSize( this );
+   rw->capacity = budget;
+   rw->max_entries = (int)( budget / 64 ) + 1; // Even an idle frame's delta takes a few bytes
+   rw->interval = interval > 0 ? interval : 1;
+   rw->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+
+   rw->data = (byte*) malloc( budget );
+   rw->entries = (Entry*) malloc( rw->max_entries * sizeof( Entry ) );
+   rw->previous = (byte*) malloc( rw->state_size );
+   rw->current = (byte*) malloc( rw->state_size );
+   rw->encoded = (byte*) malloc( rw->state_size * 2 + 32 ); // 1 zero + 1 literal alternating costs 3 bytes per 2
+   this->rewind = rw;
+
+   if( rw->data == NULL || rw->entries == NULL || rw->previous == NULL || rw->current == NULL || rw->encoded == NULL ) {
+      Nes_RewindDisable( this );
+      return false;
+   }
+   return true;
+}
+
+void Nes_RewindDisable( Nes *this )
+{
+   struct Nes_Rewind *rw = this->rewind;
+   if( rw == NULL ) {
+      return;
+   }
+   free( rw->data );
+   free( rw->entries );
+   free( rw->previous );
+   free( rw->current );
+   free( rw->encoded );
+   free( rw );
+   this->rewind = NULL;
+}
@@ -0,0 +1,12 @@
+#ifndef _Rewind_h_
+   #define _Rewind_h_
+
+#include "Nes.h"
+
+int  Nes_RewindEnable( Nes *this, size_t budget, int interval, int keyframe_interval );
+void Nes_RewindDisable( Nes *this );
+int  Nes_Rewind( Nes *this, int steps );
+
+void Rewind_Capture( Nes *this );
+
+#endif // #ifndef _Rewind_h_
@@ -0,0 +1,288 @@
+#define _POSIX_C_SOURCE 200809L // mmap(), st_mtim
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Nes.h"
+#include "Rom.h"
+#include "RomIndex.h"
+#include "Mapper.h"
+#include "RenderThread.h"
+
+// -------------------------------------------------------------------------------
+// iNES header: http://wiki.nesdev.com/w/index.php/INES
+// NES 2.0 header: http://wiki.nesdev.com/w/index.php/NES_2.0
+
+// NES 2.0 ROM size from its low byte and high nibble, in `unit` bytes or in exponent-multiplier notation
+static uint64_t nes2_rom_size( byte lsb, byte msb, uint64_t unit )
+{
+   if( msb == 0x0F ) { // 2^E * ( M * 2 + 1 ) bytes
+      int exponent = lsb >>2;
+      return ( exponent < 40 ) ? ( 1ull << exponent ) * ( ( lsb & 3 ) * 2 + 1 ) : UINT64_MAX;
+   }
+   return ( ( msb <<8 ) | lsb ) * unit;
+}
+
+// Only the 16 bytes of `header` are read, `file_size` tells whether the file is long enough for what they
+// announce. Returns false, with Rom_valid not set in info->flags, if it isn't an image that can be loaded.
+int Nes_RomParseHeader( const byte *header, uint64_t file_size, Nes_RomInfo *info )
+{
+   memset( info, 0, sizeof *info );
+   info->file_size = file_size;
+   if( file_size < 16 || memcmp( header, "NES\x1A", 4 ) != 0 ) {
+      return false;
+   }
+
+   uint64_t prg_size, chr_size;
+   if( ( header[7] & 0x0C ) == 0x08 ) { // NES 2.0
+      prg_size = nes2_rom_size( header[4], header[9] & 0x0F, PRG_ROM_bank_size );
+      chr_size = nes2_rom_size( header[5], header[9] >>4, CHR_ROM_bank_size );
+      info->mapper = ( header[6] >>4 ) | ( header[7] & 0xF0 ) | ( ( header[8] & 0x0F ) <<8 );
+      info->submapper = header[8] >>4;
+      info->flags |= Rom_nes2;
+   }
+   else {
+      prg_size = header[4] * (uint64_t) PRG_ROM_bank_size;
+      chr_size = header[5] * (uint64_t) CHR_ROM_bank_size; // 0 means the cartridge has CHR-RAM
+      info->mapper = header[6] >>4;
+      static const byte unused[4];
+      if( memcmp( &header[12], unused, 4 ) == 0 ) { // Otherwise old tools left text such as "DiskDude!" from byte 7
+         info->mapper |= header[7] & 0xF0;
+      }
+   }
+
+   if( header[6] & (1<<3) ) {
+      info->mirroring = mirroring_4screens;
+   }
+   else if( header[6] & 1 ) {
+      info->mirroring = mirroring_vertical;
+   }
+   else {
+      info->mirroring = mirroring_horizontal;
+   }
+   if( header[6] & (1<<1) ) {
+      info->flags |= Rom_battery;
+   }
+   int trainer = ( header[6] & (1<<2) ) > 0;
+   if( trainer ) {
+      info->flags |= Rom_trainer;
+   }
+
+   uint64_t offset = 16 + ( trainer ? 512 : 0 ); // skip 16 bytes header + 512B trainer
+   if( prg_size == 0 || prg_size > file_size || chr_size > file_size || offset + prg_size + chr_size > file_size ) {
+      return false;
+   }
+   info->prg_offset = (uint32_t) offset;
+   info->prg_size = (uint32_t) prg_size;
+   info->chr_size = (uint32_t) chr_size;
+   info->flags |= Rom_valid;
+   return true;
+}
+
+// -------------------------------------------------------------------------------
+// The image was parsed into `info` already, possibly by the scanner, see RomIndex.c
+static Nes_Rom *rom_from_info( const byte *image, size_t size, int storage, const Nes_RomInfo *info )
+{
+   size_t expected = info->prg_offset + (size_t) info->prg_size + info->chr_size;
+   if( ! ( info->flags & Rom_valid ) || info->prg_size < PRG_ROM_bank_size || size < expected ) {
+      return NULL;
+   }
+   if( size > expected ) {
+      fprintf( stderr, "The rom file didn't end after CHR-ROM banks as expected.\n" );
+   }
+
+   Nes_Rom *rom = (Nes_Rom*) calloc( 1, sizeof( Nes_Rom ) );
+   if( rom == NULL ) {
+      return NULL;
+   }
+   atomic_init( &rom->references, 1 );
+   rom->image = image;
+   rom->image_size = size;
+   rom->storage = storage;
+   rom->prg_rom_count = info->prg_size / PRG_ROM_bank_size;
+   rom->chr_rom_count = info->chr_size / CHR_ROM_bank_size;
+   rom->prg_rom = &image[ info->prg_offset ];
+   rom->chr_rom = rom->prg_rom + info->prg_size; // CHR-ROM immediately follows PRG-ROM
+   rom->mapper = info->mapper;
+   rom->mirroring = info->mirroring;
+
+   if( rom->chr_rom_count > 0 )
+   {
+      int banks = rom->chr_rom_count * CHR_banks_per_rom_bank;
+      rom->chr_unpacked = (byte*) malloc( banks * CHR_UNPACKED_bank_size );
+      rom->chr_opaque = (byte*) malloc( banks * CHR_OPAQUE_bank_size );
+      rom->chr_decoded = (atomic_uchar*) calloc( banks, sizeof( atomic_uchar ) );
+      if( rom->chr_unpacked == NULL || rom->chr_opaque == NULL || rom->chr_decoded == NULL ) {
+         free( rom->chr_unpacked );
+         free( rom->chr_opaque );
+         free( rom->chr_decoded );
+         free( rom );
+         return NULL;
+      }
+   }
+   return rom;
+}
+
+// Wrap an image already in memory. With Rom_storage_malloc the Nes_Rom frees it when released,
+// with Rom_storage_borrowed the caller must keep it alive. On failure the image is left to the caller.
+Nes_Rom *Nes_RomFromMemory( const byte *image, size_t size, int storage )
+{
+   Nes_RomInfo info;
+   if( ! Nes_RomParseHeader( image, size, &info ) ) {
+      return NULL;
+   }
+   return rom_from_info( image, size, storage, &info );
+}
+
+// -------------------------------------------------------------------------------
+// Map a ROM file read-only, pages are shared with every other process mapping it
+Nes_Rom *Nes_RomOpen( const char *path )
+{
+   return Nes_RomOpenIndexed( path, NULL );
+}
+
+// Same, taking what the header says from `index` (see RomIndex.c) instead of parsing it again if its
+// entry for `path` is still fresh. `index` may be NULL.
+Nes_Rom *Nes_RomOpenIndexed( const char *path, const Nes_RomIndex *index )
+{
+   int fd = open( path, O_RDONLY );
+   if( fd < 0 ) {
+      return NULL;
+   }
+   struct stat info;
+   if( fstat( fd, &info ) != 0 || info.st_size == 0 ) {
+      close( fd );
+      return NULL;
+   }
+   void *image = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+   close( fd );
+   if( image == MAP_FAILED ) {
+      return NULL;
+   }
+
+   Nes_Rom *rom = NULL;
+   const Nes_RomInfo *indexed = ( index != NULL ) ? Nes_RomIndexFind( index, path ) : NULL;
+   if( indexed != NULL && indexed->file_size == (uint64_t) info.st_size && indexed->mtime == Rom_FileTime( &info ) ) {
+      rom = rom_from_info( (const byte*) image, info.st_size, Rom_storage_mmap, indexed );
+   }
+   else {
+      rom = Nes_RomFromMemory( (const byte*) image, info.st_size, Rom_storage_mmap );
+   }
+   if( rom == NULL ) {
+      munmap( image, info.st_size );
+   }
+   return rom;
+}
+
+// -------------------------------------------------------------------------------
+Nes_Rom *Nes_RomRetain( Nes_Rom *rom )
+{
+   atomic_fetch_add_explicit( &rom->references, 1, memory_order_relaxed );
+   return rom;
+}
+
+void Nes_RomRelease( Nes_Rom *rom )
+{
+   if( rom == NULL || atomic_fetch_sub_explicit( &rom->references, 1, memory_order_acq_rel ) != 1 ) {
+      return;
+   }
+   if( rom->storage == Rom_storage_mmap ) {
+      munmap( (void*) rom->image, rom->image_size );
+   }
+   else if( rom->storage == Rom_storage_malloc ) {
+      free( (void*) rom->image );
+   }
+   free( rom->chr_unpacked );
+   free( rom->chr_opaque );
+   free( rom->chr_decoded );
+   free( rom );
+}
+
+// -------------------------------------------------------------------------------
+static const byte open_bus[PRG_bank_size]; // $8000..$FFFF without a ROM, reads 0 like read_ignore()
+
+// Point $8000..$FFFF at open bus, for an instance without a ROM. The mapper's write handlers may stay,
+// Nes_MapPrg() and Nes_MapChr() ignore them without banks to map.
+void Rom_UnmapPrg( Nes *this )
+{
+   for( int page = 0x80; page <= 0xFF; ++page ) {
+      this->read_page[page] = &open_bus[ ( page <<8 ) & ( PRG_bank_size - 1 ) ];
+   }
+   for( int window = 0; window < 4; ++window ) {
+      this->prg_ptr[window] = open_bus;
+   }
+}
+
+// -------------------------------------------------------------------------------
+// Drop the instance's ROM, called before attaching another one and by Nes_Free()
+void Rom_Detach( Nes *this )
+{
+   Nes_RenderThreadStop( this ); // Its shadow instance renders from this ROM
+   if( this->rom == NULL ) {
+      return;
+   }
+   if( this->chr_writable ) { // Unpacked CHR-RAM belongs to the instance
+      free( this->chr_unpacked );
+      free( this->chr_opaque );
+      free( this->chr_decoded );
+   }
+   Nes_RomRelease( this->rom );
+
+   this->rom = NULL;
+   this->prg_rom = NULL;
+   this->prg_rom_count = 0;
+   this->chr_rom = NULL;
+   this->chr_rom_count = 0;
+   this->chr_writable = 0;
+   this->chr_unpacked = NULL;
+   this->chr_opaque = NULL;
+   this->chr_decoded = NULL;
+   this->background_dirty = true; // The banks it was rendered with are gone
+   Rom_UnmapPrg( this );
+}
+
+// -------------------------------------------------------------------------------
+// Run `rom` on this instance. Only the mutable parts (CHR-RAM and its unpacked copy) are allocated,
+// everything else is shared with the other instances attached to the same Nes_Rom.
+int Nes_AttachRom( Nes *this, Nes_Rom *rom )
+{
+   Rom_Detach( this );
+   this->rom = Nes_RomRetain( rom );
+
+   this->prg_rom = rom->prg_rom;
+   this->prg_rom_count = rom->prg_rom_count;
+   this->chr_writable = ( rom->chr_rom_count == 0 );
+   if( this->chr_writable ) {
+      memset( this->chr_ram, 0, sizeof this->chr_ram );
+      this->chr_rom = this->chr_ram;
+      this->chr_rom_count = 1;
+      this->chr_unpacked = (byte*) malloc( CHR_banks_per_rom_bank * CHR_UNPACKED_bank_size );
+      this->chr_opaque = (byte*) malloc( CHR_banks_per_rom_bank * CHR_OPAQUE_bank_size );
+      this->chr_decoded = (atomic_uchar*) calloc( CHR_banks_per_rom_bank, sizeof( atomic_uchar ) );
+      if( this->chr_unpacked == NULL || this->chr_opaque == NULL || this->chr_decoded == NULL ) {
+         Rom_Detach( this );
+         return false;
+      }
+   }
+   else {
+      this->chr_rom = rom->chr_rom;
+      this->chr_rom_count = rom->chr_rom_count;
+      this->chr_unpacked = rom->chr_unpacked;
+      this->chr_opaque = rom->chr_opaque;
+      this->chr_decoded = rom->chr_decoded;
+   }
+
+   Nes_SetMirroring( this, rom->mirroring );
+
+   // Maps the PRG and CHR banks and takes over writes to $8000..$FFFF
+   if( ! Mapper_Init( this, rom->mapper ) ) {
+      fprintf( stderr, "Mapper %d not supported.\n", rom->mapper );
+      Rom_Detach( this );
+      return false;
+   }
+   return true;
+}
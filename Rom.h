@@ -0,0 +1,73 @@
+#ifndef _Rom_h_
+   #define _Rom_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "Nes.h"
+
+// A parsed ROM image, immutable and shared by every Nes instance running it. Reference counted.
+typedef struct Nes_Rom
+{
+   atomic_int references;
+
+   const byte *image;  // The whole file: mmap'ed, malloc'ed or owned by the caller, see `storage`
+   size_t image_size;
+   int storage;
+
+   const byte *prg_rom;
+   int prg_rom_count;  // 16kB banks
+   const byte *chr_rom;
+   int chr_rom_count;  // 8kB banks, 0 for CHR-RAM cartridges
+   int mapper;
+   int mirroring;
+
+   // CHR-ROM unpacked to 1 byte per pixel, decoded lazily per 1kB bank by whichever instance maps it
+   // first. States per bank: 0 not decoded, 1 being decoded, 2 ready.
+   byte *chr_unpacked;
+   byte *chr_opaque;
+   atomic_uchar *chr_decoded;
+} Nes_Rom;
+
+// What the header of an iNES or NES 2.0 image says, see Nes_RomParseHeader(). Also the record of a ROM
+// in the library index, see RomIndex.c, so its layout is part of the index file format.
+typedef struct Nes_RomInfo
+{
+   uint64_t file_size;
+   int64_t mtime;        // Nanoseconds, filled by the scanner to tell stale index entries
+   uint64_t prg_hash;    // FNV-1a of PRG-ROM, filled by the scanner
+   uint64_t chr_hash;    // Same for CHR-ROM, the hash of nothing with CHR-RAM
+   uint32_t prg_offset;  // In the file, after the header and the trainer
+   uint32_t prg_size;    // Bytes, PRG_ROM_bank_size multiples unless NES 2.0 says otherwise
+   uint32_t chr_size;    // Bytes, 0 for CHR-RAM cartridges
+   uint16_t mapper;
+   byte submapper;       // NES 2.0 only
+   byte mirroring;       // mirroring_vertical, mirroring_horizontal or mirroring_4screens
+   byte flags;           // Rom_valid, Rom_trainer, Rom_battery, Rom_nes2
+   byte reserved[7];
+} Nes_RomInfo;
+
+enum {
+   Rom_valid   = 1 <<0,  // Parsed and the file holds every byte the header announces
+   Rom_trainer = 1 <<1,
+   Rom_battery = 1 <<2,  // Battery backed save RAM
+   Rom_nes2    = 1 <<3
+};
+
+enum {
+   Rom_storage_mmap     = 0,
+   Rom_storage_malloc   = 1,
+   Rom_storage_borrowed = 2  // The caller keeps the buffer alive while the Nes_Rom lives
+};
+
+int      Nes_RomParseHeader( const byte *header, uint64_t file_size, Nes_RomInfo *info );
+Nes_Rom *Nes_RomOpen( const char *path );
+Nes_Rom *Nes_RomFromMemory( const byte *image, size_t size, int storage );
+Nes_Rom *Nes_RomRetain( Nes_Rom *rom );
+void     Nes_RomRelease( Nes_Rom *rom );
+int      Nes_AttachRom( Nes *this, Nes_Rom *rom );
+
+void Rom_Detach( Nes *this );
+void Rom_UnmapPrg( Nes *this );
+
+#endif // #ifndef _Rom_h_
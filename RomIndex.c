@@ -0,0 +1,295 @@
+#define _POSIX_C_SOURCE 200809L // pread(), st_mtim
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Nes.h"
+#include "Rom.h"
+#include "RomIndex.h"
+
+// Library scanning: a ROM image is known by its 16 byte header and the hashes of its PRG and CHR payloads.
+// The scanner reads those with pread(), nothing is mapped or allocated per file, and spreads the files over
+// threads. The index file keeps the results for the loader, Nes_RomOpenIndexed() takes the header from it
+// instead of parsing it again while the file keeps its size and modification time.
+//
+// Index file layout: Index_header, `count` Index_records sorted by path hash, then the NUL terminated paths.
+// Records are Nes_RomInfo as is, like save states an index belongs to the build that wrote it.
+
+#define Index_version 1
+#define Scan_chunk    0x10000 // Bytes hashed per read
+#define Fnv_basis     0xCBF29CE484222325ull
+
+typedef struct
+{
+   char magic[4];        // "NESi"
+   uint32_t version;
+   uint32_t count;
+   uint32_t record_size; // Differs if written by a build with another Nes_RomInfo
+   uint64_t strings_size;
+} Index_header;
+
+typedef struct
+{
+   uint64_t path_hash;
+   uint64_t path_offset; // In the paths following the records
+   Nes_RomInfo info;
+} Index_record;
+
+struct Nes_RomIndex
+{
+   byte *data;           // The whole file
+   int count;
+   const Index_record *records;
+   const char *strings;
+};
+
+// -------------------------------------------------------------------------------
+static uint64_t hash_bytes( uint64_t hash, const byte *data, size_t size ) // FNV-1a, as Movie_HashRam()
+{
+   for( size_t i = 0; i < size; ++i ) {
+      hash = ( hash ^ data[i] ) * 0x100000001B3ull;
+   }
+   return hash;
+}
+
+static uint64_t hash_path( const char *path )
+{
+   return hash_bytes( Fnv_basis, (const byte*) path, strlen( path ) );
+}
+
+static int hash_file_range( int fd, uint64_t offset, uint64_t size, byte *buffer, uint64_t *hash )
+{
+   *hash = Fnv_basis;
+   while( size > 0 )
+   {
+      ssize_t got = pread( fd, buffer, size < Scan_chunk ? size : Scan_chunk, offset );
+      if( got <= 0 ) {
+         return false;
+      }
+      *hash = hash_bytes( *hash, buffer, got );
+      offset += got;
+      size -= got;
+   }
+   return true;
+}
+
+static void scan_file( const char *path, Nes_RomInfo *info, byte *buffer )
+{
+   memset( info, 0, sizeof *info );
+   int fd = open( path, O_RDONLY );
+   if( fd < 0 ) {
+      return;
+   }
+   struct stat stat_info;
+   byte header[16];
+   if( fstat( fd, &stat_info ) == 0 && pread( fd, header, sizeof header, 0 ) == sizeof header
+      && Nes_RomParseHeader( header, stat_info.st_size, info ) )
+   {
+      info->mtime = Rom_FileTime( &stat_info );
+      uint64_t chr_offset = (uint64_t) info->prg_offset + info->prg_size;
+      if( ! hash_file_range( fd, info->prg_offset, info->prg_size, buffer, &info->prg_hash )
+         || ! hash_file_range( fd, chr_offset, info->chr_size, buffer, &info->chr_hash ) )
+      {
+         info->flags &= ~Rom_valid;
+      }
+   }
+   close( fd );
+}
+
+// -------------------------------------------------------------------------------
+typedef struct
+{
+   const char **paths;
+   Nes_RomInfo *infos;
+   int count;
+   atomic_int next;
+} Scan;
+
+static void *scan_worker( void *arg )
+{
+   Scan *scan = (Scan*) arg;
+   byte *buffer = (byte*) malloc( Scan_chunk );
+   if( buffer == NULL ) {
+      return NULL; // The other threads scan the files
+   }
+   int file;
+   while(( file = atomic_fetch_add_explicit( &scan->next, 1, memory_order_relaxed )) < scan->count ) {
+      scan_file( scan->paths[file], &scan->infos[file], buffer );
+   }
+   free( buffer );
+   return NULL;
+}
+
+// Fill infos[i] from the header of paths[i] and hash its payloads, over `threads` threads (0 for one per
+// online core). Files that can't be read or loaded get an info without Rom_valid. Returns how many can.
+int Nes_RomScan( const char **paths, int count, int threads, Nes_RomInfo *infos )
+{
+   if( threads <= 0 ) {
+      threads = (int) sysconf( _SC_NPROCESSORS_ONLN );
+   }
+   if( threads > count ) {
+      threads = count;
+   }
+   Scan scan = { .paths = paths, .infos = infos, .count = count };
+   atomic_init( &scan.next, 0 );
+   pthread_t *thread = ( threads > 1 ) ? (pthread_t*) malloc( ( threads - 1 ) * sizeof( pthread_t ) ) : NULL;
+   int started = 0;
+   for( int i = 0; thread != NULL && i < threads - 1; ++i ) {
+      if( pthread_create( &thread[i], NULL, scan_worker, &scan ) != 0 ) {
+         break; // Scan with the threads there are
+      }
+      started++;
+   }
+   scan_worker( &scan );
+   for( int i = 0; i < started; ++i ) {
+      pthread_join( thread[i], NULL );
+   }
+   free( thread );
+
+   if( atomic_load( &scan.next ) < count ) { // No thread could allocate its buffer
+      for( int i = 0; i < count; ++i ) {
+         memset( &infos[i], 0, sizeof infos[i] );
+      }
+   }
+   int valid = 0;
+   for( int i = 0; i < count; ++i ) {
+      valid += ( infos[i].flags & Rom_valid ) != 0;
+   }
+   return valid;
+}
+
+// -------------------------------------------------------------------------------
+static int compare_records( const void *a, const void *b )
+{
+   uint64_t hash_a = ( (const Index_record*) a )->path_hash, hash_b = ( (const Index_record*) b )->path_hash;
+   return ( hash_a > hash_b ) - ( hash_a < hash_b );
+}
+
+// Write the valid entries of a scan to `index_path`. Paths are stored as given, look them up the same way.
+int Nes_RomIndexSave( const char *index_path, const char **paths, const Nes_RomInfo *infos, int count )
+{
+   Index_record *records = (Index_record*) malloc( ( count > 0 ? count : 1 ) * sizeof( Index_record ) );
+   if( records == NULL ) {
+      return false;
+   }
+   Index_header header;
+   memcpy( header.magic, "NESi", 4 );
+   header.version = Index_version;
+   header.count = 0;
+   header.record_size = sizeof( Index_record );
+   header.strings_size = 0;
+   for( int i = 0; i < count; ++i ) {
+      if( infos[i].flags & Rom_valid ) {
+         Index_record *record = &records[ header.count++ ];
+         memset( record, 0, sizeof *record );
+         record->path_hash = hash_path( paths[i] );
+         record->path_offset = header.strings_size;
+         record->info = infos[i];
+         header.strings_size += strlen( paths[i] ) + 1;
+      }
+   }
+   qsort( records, header.count, sizeof( Index_record ), compare_records );
+
+   FILE *file = fopen( index_path, "wb" );
+   if( file == NULL ) {
+      free( records );
+      return false;
+   }
+   int ok = fwrite( &header, sizeof header, 1, file ) == 1
+      && fwrite( records, sizeof( Index_record ), header.count, file ) == header.count;
+   for( int i = 0; ok && i < count; ++i ) { // In the order their offsets were given
+      if( infos[i].flags & Rom_valid ) {
+         ok = fwrite( paths[i], strlen( paths[i] ) + 1, 1, file ) == 1;
+      }
+   }
+   free( records );
+   return ( fclose( file ) == 0 ) && ok;
+}
+
+// -------------------------------------------------------------------------------
+Nes_RomIndex *Nes_RomIndexLoad( const char *index_path )
+{
+   FILE *file = fopen( index_path, "rb" );
+   if( file == NULL ) {
+      return NULL;
+   }
+   Nes_RomIndex *index = NULL;
+   Index_header header;
+   long size = ( fseek( file, 0, SEEK_END ) == 0 ) ? ftell( file ) : -1;
+   rewind( file );
+   if( size >= (long) sizeof header && fread( &header, sizeof header, 1, file ) == 1
+      && memcmp( header.magic, "NESi", 4 ) == 0 && header.version == Index_version
+      && header.record_size == sizeof( Index_record )
+      && (uint64_t) size == sizeof header + (uint64_t) header.count * sizeof( Index_record ) + header.strings_size )
+   {
+      index = (Nes_RomIndex*) calloc( 1, sizeof( Nes_RomIndex ) );
+      if( index != NULL ) {
+         index->data = (byte*) malloc( size );
+         rewind( file );
+         if( index->data == NULL || fread( index->data, size, 1, file ) != 1 ) {
+            Nes_RomIndexFree( index );
+            index = NULL;
+         }
+      }
+   }
+   fclose( file );
+   if( index == NULL ) {
+      fprintf( stderr, "Couldn't load ROM index %s.\n", index_path );
+      return NULL;
+   }
+
+   index->count = header.count;
+   index->records = (const Index_record*) ( index->data + sizeof header );
+   index->strings = (const char*)( index->records + header.count );
+   int valid = ( header.strings_size == 0 || index->strings[ header.strings_size - 1 ] == '\0' );
+   for( int i = 0; valid && i < index->count; ++i ) {
+      valid = index->records[i].path_offset < header.strings_size;
+   }
+   if( ! valid ) {
+      fprintf( stderr, "ROM index %s is corrupt.\n", index_path );
+      Nes_RomIndexFree( index );
+      return NULL;
+   }
+   return index;
+}
+
+void Nes_RomIndexFree( Nes_RomIndex *index )
+{
+   if( index == NULL ) {
+      return;
+   }
+   free( index->data );
+   free( index );
+}
+
+int Nes_RomIndexCount( const Nes_RomIndex *index )
+{
+   return index->count;
+}
+
+// The entry of `path`, NULL if it isn't indexed. The file may have changed since, compare its file_size and
+// mtime to the file's before trusting it.
+const Nes_RomInfo *Nes_RomIndexFind( const Nes_RomIndex *index, const char *path )
+{
+   uint64_t hash = hash_path( path );
+   int low = 0, high = index->count; // First record with a hash >= `hash`
+   while( low < high ) {
+      int middle = ( low + high ) / 2;
+      if( index->records[middle].path_hash < hash ) {
+         low = middle + 1;
+      }
+      else {
+         high = middle;
+      }
+   }
+   for( ; low < index->count && index->records[low].path_hash == hash; ++low ) {
+      if( strcmp( &index->strings[ index->records[low].path_offset ], path ) == 0 ) {
+         return &index->records[low].info;
+      }
+   }
+   return NULL;
+}
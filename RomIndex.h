@@ -0,0 +1,26 @@
+#ifndef _RomIndex_h_
+   #define _RomIndex_h_
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "Rom.h"
+
+// Headers and payload hashes of a library of ROM images, scanned in parallel and kept in an index file
+typedef struct Nes_RomIndex Nes_RomIndex;
+
+int  Nes_RomScan( const char **paths, int count, int threads, Nes_RomInfo *infos );
+int  Nes_RomIndexSave( const char *index_path, const char **paths, const Nes_RomInfo *infos, int count );
+Nes_RomIndex *Nes_RomIndexLoad( const char *index_path );
+void Nes_RomIndexFree( Nes_RomIndex *index );
+int  Nes_RomIndexCount( const Nes_RomIndex *index );
+const Nes_RomInfo *Nes_RomIndexFind( const Nes_RomIndex *index, const char *path );
+Nes_Rom *Nes_RomOpenIndexed( const char *path, const Nes_RomIndex *index );
+
+// Modification time Nes_RomInfo.mtime holds, to tell whether a file changed since it was indexed. st_mtim is
+// POSIX.1-2008, define _POSIX_C_SOURCE 200809L before any include where this is used.
+static inline int64_t Rom_FileTime( const struct stat *info )
+{
+   return (int64_t) info->st_mtim.tv_sec * 1000000000 + info->st_mtim.tv_nsec;
+}
+
+#endif // #ifndef _RomIndex_h_
@@ -0,0 +1,302 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "Nes.h"
+#include "Rom.h"
+#include "Rewind.h"
+#include "Movie.h"
+#include "Export.h"
+
+// Save state layout: State_header, CPU registers, the Nes state block (see Nes_state_offset).
+// ROM data is not saved, the state can only be loaded into an instance running the same ROM.
+
+#define State_version 1
+
+typedef struct
+{
+   char magic[4];          // "NESs"
+   uint32_t version;
+   uint32_t cpu_size;
+   uint32_t state_size;    // Differs if the state was saved by a build with another layout
+   int32_t mapper;
+   int32_t prg_rom_count;
+   int32_t chr_rom_count;
+} State_header;
+
+// Cpu6502 keeps its registers around its two 64K memory handler tables, those are skipped
+#define Cpu_tables_end ( offsetof( Cpu6502, write_memory ) + sizeof( ((Cpu6502*)0)->write_memory ) )
+#define Cpu_head_size  offsetof( Cpu6502, read_memory )
+#define Cpu_tail_size  ( sizeof( Cpu6502 ) - Cpu_tables_end )
+
+// -------------------------------------------------------------------------------
+// Point the memory maps at the banks the state selects and flag the caches derived from it
+static void rebuild_maps( Nes *this )
+{
+   for( int window = 0; window < 4; ++window ) {
+      Nes_MapPrg( this, window, this->mapper.prg_bank[window] );
+   }
+   for( int window = 0; window < 8; ++window ) {
+      Nes_MapChr( this, window, this->mapper.chr_bank[window] );
+   }
+   Nes_SetMirroring( this, this->ppu.mirroring );
+   this->palette_dirty = true;
+   this->sprites_dirty = true;
+   this->background_dirty = true;
+   Nes_ForgetIdleLoop( this );
+}
+
+// -------------------------------------------------------------------------------
+size_t Nes_StateSize( Nes *this )
+{
+   return sizeof( State_header ) + Cpu_head_size + Cpu_tail_size + Nes_state_size;
+}
+
+// -------------------------------------------------------------------------------
+// `buffer` must hold Nes_StateSize() bytes. Returns the bytes written.
+size_t Nes_SaveState( Nes *this, void *buffer )
+{
+   State_header header;
+   memcpy( header.magic, "NESs", 4 );
+   header.version       = State_version;
+   header.cpu_size      = Cpu_head_size + Cpu_tail_size;
+   header.state_size    = Nes_state_size;
+   header.mapper        = this->mapper.id;
+   header.prg_rom_count = this->prg_rom_count;
+   header.chr_rom_count = this->chr_rom_count;
+
+   byte *out = (byte*) buffer;
+   memcpy( out, &header, sizeof header );
+   out += sizeof header;
+   memcpy( out, this->cpu, Cpu_head_size );
+   out += Cpu_head_size;
+   memcpy( out, (byte*) this->cpu + Cpu_tables_end, Cpu_tail_size );
+   out += Cpu_tail_size;
+   memcpy( out, (byte*) this + Nes_state_offset, Nes_state_size );
+
+   return Nes_StateSize( this );
+}
+
+// -------------------------------------------------------------------------------
+// Returns false, leaving the instance untouched, if the state doesn't belong to this build and ROM
+int Nes_LoadState( Nes *this, const void *buffer, size_t size )
+{
+   State_header header;
+   if( size != Nes_StateSize( this ) ) {
+      return false;
+   }
+   memcpy( &header, buffer, sizeof header );
+   if( memcmp( header.magic, "NESs", 4 ) != 0 || header.version != State_version
+      || header.cpu_size != Cpu_head_size + Cpu_tail_size || header.state_size != Nes_state_size
+      || header.mapper != this->mapper.id || header.prg_rom_count != this->prg_rom_count
+      || header.chr_rom_count != this->chr_rom_count || this->prg_rom == NULL )
+   {
+      return false;
+   }
+
+   const byte *in = (const byte*) buffer + sizeof header;
+   void *parent_system = this->cpu->parent_system; // Pointers in the saved registers belong to another instance
+   #ifdef _Cpu6502_Disassembler
+      void *read_memory_disasm = this->cpu->read_memory_disasm;
+   #endif
+   memcpy( this->cpu, in, Cpu_head_size );
+   in += Cpu_head_size;
+   memcpy( (byte*) this->cpu + Cpu_tables_end, in, Cpu_tail_size );
+   in += Cpu_tail_size;
+   this->cpu->parent_system = parent_system;
+   #ifdef _Cpu6502_Disassembler
+      this->cpu->read_memory_disasm = read_memory_disasm;
+   #endif
+   memcpy( (byte*) this + Nes_state_offset, in, Nes_state_size );
+   this->vram_write_count = 0; // Logged against the memory just replaced
+
+   // Rebuild what is derived from the state: memory maps and, for CHR-RAM, the unpacked patterns
+   if( this->chr_writable ) {
+      for( int bank = 0; bank < CHR_banks_per_rom_bank; ++bank ) {
+         atomic_store( &this->chr_decoded[bank], 0 );
+      }
+   }
+   rebuild_maps( this );
+
+   return true;
+}
+
+// -------------------------------------------------------------------------------
+// Cloning: a copy of an instance for branching off its emulation, e.g. to search ahead. ROM data is shared,
+// only the registers, the state block and CHR-RAM are copied. Released instances go to a pool and are
+// reused with their 64K handler tables as they are, only $8000..$FFFF writes differ between mappers.
+
+#define Pool_capacity 32 // Each pooled instance holds about 1.4MB, mostly the handler tables
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Nes *pool[Pool_capacity];
+static int pool_count;
+
+typedef void (*Write_handler)( void *sys, word address, byte value );
+
+// A pooled instance, preferably one already set up for the `mapper` write handler, NULL if none
+static Nes *take_pooled( Write_handler mapper )
+{
+   Nes *nes = NULL;
+   pthread_mutex_lock( &pool_lock );
+   if( pool_count > 0 )
+   {
+      int i = pool_count - 1;
+      while( i > 0 && pool[i]->cpu->write_memory[0x8000] != mapper ) {
+         --i;
+      }
+      nes = pool[i];
+      pool[i] = pool[ --pool_count ];
+   }
+   pthread_mutex_unlock( &pool_lock );
+   return nes;
+}
+
+// Returns NULL if out of memory or `source` has no ROM. The clone has no rewind, audio nor movie, and
+// its framebuffer is only filled by the next frame. Sources with CHR-RAM cost an extra copy of their
+// unpacked patterns. With the pool empty this is a whole Nes_Create(), 128K handlers written, and a pooled
+// instance last used with another mapper gets its 32K $8000..$FFFF handlers rewritten: Nes_WarmPool()
+// beforehand keeps both off the cloning path (see clone_cold_us in bench/Benchmark.c).
+Nes *Nes_Clone( const Nes *source )
+{
+   if( source->rom == NULL ) {
+      return NULL;
+   }
+   Write_handler mapper = source->cpu->write_memory[0x8000];
+   Nes *this = take_pooled( mapper );
+   if( this == NULL && ( this = Nes_Create() ) == NULL ) {
+      return NULL;
+   }
+   if( this->cpu->write_memory[0x8000] != mapper ) {
+      for( int i = 0x8000; i <= 0xFFFF; ++i ) {
+         this->cpu->write_memory[i] = mapper;
+      }
+   }
+   this->mapper_scanline = source->mapper_scanline;
+
+   this->rom = Nes_RomRetain( source->rom );
+   this->prg_rom = source->prg_rom;
+   this->prg_rom_count = source->prg_rom_count;
+   this->chr_rom_count = source->chr_rom_count;
+   this->chr_writable = source->chr_writable;
+   if( this->chr_writable ) {
+      this->chr_rom = this->chr_ram;
+      this->chr_unpacked = (byte*) malloc( CHR_banks_per_rom_bank * CHR_UNPACKED_bank_size );
+      this->chr_opaque = (byte*) malloc( CHR_banks_per_rom_bank * CHR_OPAQUE_bank_size );
+      this->chr_decoded = (atomic_uchar*) malloc( CHR_banks_per_rom_bank * sizeof( atomic_uchar ) );
+      if( this->chr_unpacked == NULL || this->chr_opaque == NULL || this->chr_decoded == NULL ) {
+         Nes_Free( this ); // Frees them too
+         return NULL;
+      }
+      memcpy( this->chr_unpacked, source->chr_unpacked, CHR_banks_per_rom_bank * CHR_UNPACKED_bank_size );
+      memcpy( this->chr_opaque, source->chr_opaque, CHR_banks_per_rom_bank * CHR_OPAQUE_bank_size );
+      for( int bank = 0; bank < CHR_banks_per_rom_bank; ++bank ) {
+         atomic_init( &this->chr_decoded[bank], atomic_load( &source->chr_decoded[bank] ) );
+      }
+   }
+   else {
+      this->chr_rom = source->chr_rom;
+      this->chr_unpacked = source->chr_unpacked;
+      this->chr_opaque = source->chr_opaque;
+      this->chr_decoded = source->chr_decoded;
+   }
+
+   void *parent_system = this->cpu->parent_system;
+   #ifdef _Cpu6502_Disassembler
+      void *read_memory_disasm = this->cpu->read_memory_disasm;
+   #endif
+   memcpy( this->cpu, source->cpu, Cpu_head_size );
+   memcpy( (byte*) this->cpu + Cpu_tables_end, (const byte*) source->cpu + Cpu_tables_end, Cpu_tail_size );
+   this->cpu->parent_system = parent_system;
+   #ifdef _Cpu6502_Disassembler
+      this->cpu->read_memory_disasm = read_memory_disasm;
+   #endif
+   if( this->chr_writable ) {
+      memcpy( (byte*) this + Nes_state_offset, (const byte*) source + Nes_state_offset, Nes_state_size );
+   }
+   else { // chr_ram is unused, that's a third of the state block
+      size_t chr_ram = offsetof( Nes, chr_ram ), after = chr_ram + sizeof this->chr_ram;
+      memcpy( (byte*) this + Nes_state_offset, (const byte*) source + Nes_state_offset, chr_ram - Nes_state_offset );
+      memcpy( (byte*) this + after, (const byte*) source + after, sizeof( Nes ) - after );
+   }
+
+   long next_event = this->next_event; // Nes_MapChr() reschedules, keep the state exactly as the source's
+   rebuild_maps( this );
+   this->next_event = next_event;
+   this->render_skip = source->render_skip;
+   this->vram_logging = ( this->render_skip != 0 );
+   this->vram_write_count = 0;
+   this->idle_skip = source->idle_skip;
+   this->line_state_count = 0; // Lines the source didn't render yet point at its name tables
+   memset( this->line_state, 0xFF, sizeof this->line_state );
+   Nes_ResetProfile( this ); // Counts the clone's own run, not the source's
+   return this;
+}
+
+// Hands an instance over to the pool for Nes_Clone(), frees it if the pool is full
+void Nes_Release( Nes *this )
+{
+   Nes_RewindDisable( this );
+   Nes_ExportStop( this );
+   Nes_AudioDisable( this );
+   Nes_MovieStop( this );
+   if( this->chr_writable ) { // Clones of CHR-ROM sources don't copy chr_ram, leave it as a fresh instance has it
+      memset( this->chr_ram, 0, sizeof this->chr_ram );
+   }
+   Rom_Detach( this );
+   this->render_skip = 0;
+   this->vram_logging = false;
+   this->vram_write_count = 0;
+   this->idle_skip = true;
+   Nes_ResetProfile( this );
+   Nes_SetFramebuffer( this, NULL );
+
+   pthread_mutex_lock( &pool_lock );
+   if( pool_count < Pool_capacity ) {
+      pool[ pool_count++ ] = this;
+      this = NULL;
+   }
+   pthread_mutex_unlock( &pool_lock );
+   if( this != NULL ) {
+      Nes_Free( this );
+   }
+}
+
+// Create up to `count` instances for the pool ahead of cloning `source`, with its mapper's handlers already
+// in place. Stops when the pool is full. Returns how many were added.
+int Nes_WarmPool( const Nes *source, int count )
+{
+   Write_handler mapper = source->cpu->write_memory[0x8000];
+   int added = 0;
+   for( ; added < count; ++added )
+   {
+      Nes *nes = Nes_Create();
+      if( nes == NULL ) {
+         break;
+      }
+      for( int i = 0x8000; i <= 0xFFFF; ++i ) {
+         nes->cpu->write_memory[i] = mapper;
+      }
+      pthread_mutex_lock( &pool_lock );
+      int pooled = ( pool_count < Pool_capacity );
+      if( pooled ) {
+         pool[ pool_count++ ] = nes;
+      }
+      pthread_mutex_unlock( &pool_lock );
+      if( ! pooled ) {
+         Nes_Free( nes );
+         break;
+      }
+   }
+   return added;
+}
+
+// Frees the pooled instances
+void Nes_FreePool( void )
+{
+   pthread_mutex_lock( &pool_lock );
+   while( pool_count > 0 ) {
+      Nes_Free( pool[ --pool_count ] );
+   }
+   pthread_mutex_unlock( &pool_lock );
+}
@@ -0,0 +1,342 @@
+// Throughput benchmarks for the core, no ROM files needed: every workload is a small 6502 program
+// assembled in memory into an NROM image. Results are printed as one JSON object on stdout.
+//
+// Build from the repository root along with the Cpu6502 core:
+//    cc -O2 -I. -I<Cpu6502 dir> bench/Benchmark.c *.c <Cpu6502 dir>/Cpu6502.c -lpthread -lm -o nes_bench
+// Usage: nes_bench [frames per workload]
+
+#define _POSIX_C_SOURCE 200809L // clock_gettime()
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "Nes.h"
+#include "Rom.h"
+
+#define Prg_base 0xC000 // The 16kB PRG bank is mirrored at $8000 and $C000, code is assembled for $C000
+
+// -------------------------------------------------------------------------------
+// Just enough of an assembler: emit opcodes and operands at the current address
+typedef struct
+{
+   byte image[ 16 + PRG_ROM_bank_size + CHR_ROM_bank_size ];
+   word pc;
+} Asm;
+
+static void emit( Asm *a, byte value )
+{
+   a->image[ 16 + ( a->pc - Prg_base ) ] = value;
+   a->pc++;
+}
+static void op( Asm *a, byte opcode ) { emit( a, opcode ); }
+static void op8( Asm *a, byte opcode, byte operand ) { emit( a, opcode ); emit( a, operand ); }
+static void op16( Asm *a, byte opcode, word operand ) { emit( a, opcode ); emit( a, operand & 0xFF ); emit( a, operand >>8 ); }
+static void branch( Asm *a, byte opcode, word target ) { emit( a, opcode ); emit( a, (byte)( target - ( a->pc + 1 ) ) ); }
+
+enum { // Opcodes used by the workloads
+   LDA_imm = 0xA9, LDA_abs = 0xAD, STA_abs = 0x8D, STA_zpx = 0x95, LDX_imm = 0xA2, INX = 0xE8,
+   INC_zp = 0xE6, JMP_abs = 0x4C, BNE = 0xD0, BPL = 0x10, SEI = 0x78, CLD = 0xD8, TXS = 0x9A, RTI = 0x40,
+   AND_imm = 0x29, BEQ = 0xF0
+};
+
+// Start the program: header, reset code, the NMI handler is a bare RTI
+static void begin( Asm *a )
+{
+   memset( a->image, 0, sizeof a->image );
+   memcpy( a->image, "NES\x1A", 4 );
+   a->image[4] = 1; // 16kB PRG-ROM
+   a->image[5] = 1; // 8kB CHR-ROM
+   for( int i = 0; i < CHR_ROM_bank_size; ++i ) {
+      a->image[ 16 + PRG_ROM_bank_size + i ] = (byte)( i * 7 + ( i >>4 ) );
+   }
+
+   a->pc = 0xFFF0;
+   word nmi = a->pc;
+   op( a, RTI );
+   a->image[ 16 + 0x3FFA ] = nmi & 0xFF; // NMI vector
+   a->image[ 16 + 0x3FFB ] = nmi >>8;
+   a->image[ 16 + 0x3FFC ] = Prg_base & 0xFF; // Reset vector
+   a->image[ 16 + 0x3FFD ] = Prg_base >>8;
+
+   a->pc = Prg_base;
+   op( a, SEI );
+   op( a, CLD );
+   op8( a, LDX_imm, 0xFF );
+   op( a, TXS );
+   op8( a, LDA_imm, 0x80 ); // NMI on
+   op16( a, STA_abs, 0x2000 );
+   op8( a, LDA_imm, 0x1E ); // Background and sprites visible
+   op16( a, STA_abs, 0x2001 );
+}
+
+// -------------------------------------------------------------------------------
+// Workloads, each one an endless loop
+
+static void ram_loop( Asm *a ) // Plain CPU and RAM traffic
+{
+   word loop = a->pc;
+   op( a, INX );
+   op8( a, STA_zpx, 0x20 );
+   op8( a, INC_zp, 0x10 );
+   op16( a, JMP_abs, loop );
+}
+
+static void vram_storm( Asm *a ) // $2007 uploads, 256 bytes per $2006 address set
+{
+   word loop = a->pc;
+   op8( a, LDA_imm, 0x20 );
+   op16( a, STA_abs, 0x2006 );
+   op8( a, LDA_imm, 0x00 );
+   op16( a, STA_abs, 0x2006 );
+   op8( a, LDX_imm, 0x00 );
+   word inner = a->pc;
+   op16( a, STA_abs, 0x2007 );
+   op( a, INX );
+   branch( a, BNE, inner );
+   op16( a, JMP_abs, loop );
+}
+
+static void oam_dma( Asm *a ) // Sprite DMA from page 2 over and over
+{
+   word loop = a->pc;
+   op8( a, LDA_imm, 0x02 );
+   op16( a, STA_abs, 0x4014 );
+   op16( a, JMP_abs, loop );
+}
+
+static void status_poll( Asm *a ) // Waiting for vblank on $2002
+{
+   word loop = a->pc;
+   op16( a, LDA_abs, 0x2002 );
+   branch( a, BPL, loop );
+   op16( a, JMP_abs, loop );
+}
+
+static void overflow_poll( Asm *a ) // Waiting for sprite overflow on $2002, then counting until it clears
+{
+   for( int sprite = 0; sprite < 64; ++sprite ) { // 9 sprites on line 100, the others below the screen
+      op8( a, LDA_imm, ( sprite >= 1 && sprite <= 9 ) ? 99 : 0xEF ); // Not sprite 0, its hit would end the skip there
+      op16( a, STA_abs, 0x2004 );
+      op8( a, LDA_imm, 0 );
+      op16( a, STA_abs, 0x2004 );
+      op16( a, STA_abs, 0x2004 );
+      op8( a, LDA_imm, sprite * 24 );
+      op16( a, STA_abs, 0x2004 );
+   }
+   word wait = a->pc;
+   op16( a, LDA_abs, 0x2002 );
+   op8( a, AND_imm, 0x20 );
+   branch( a, BEQ, wait );
+   word count = a->pc; // How far it gets depends on the cycle the overflow was seen on
+   op8( a, INC_zp, 0x10 );
+   op16( a, LDA_abs, 0x2002 );
+   op8( a, AND_imm, 0x20 );
+   branch( a, BNE, count );
+   op16( a, JMP_abs, wait );
+}
+
+// -------------------------------------------------------------------------------
+static double now( void )
+{
+   struct timespec t;
+   clock_gettime( CLOCK_MONOTONIC, &t );
+   return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static Nes *boot( Asm *a, Nes_Rom **rom )
+{
+   *rom = Nes_RomFromMemory( a->image, sizeof a->image, Rom_storage_borrowed );
+   Nes *nes = Nes_Create();
+   if( *rom == NULL || nes == NULL || ! Nes_AttachRom( nes, *rom ) ) {
+      fprintf( stderr, "Couldn't boot the benchmark image.\n" );
+      exit( 1 );
+   }
+   Nes_Reset( nes );
+   return nes;
+}
+
+// ns_per_cpu_cycle counts the cycles fast-forwarded over by idle loop skipping too, ns_per_instruction
+// only the instructions the core stepped
+static void run_workload( const char *name, void (*program)( Asm *a ), int frames, int idle_skip, int first )
+{
+   static Asm a;
+   Nes_Rom *rom;
+   begin( &a );
+   program( &a );
+   Nes *nes = boot( &a, &rom );
+   Nes_SetIdleSkip( nes, idle_skip );
+
+   long cycles = nes->cpu_cycles;
+   unsigned long instructions = nes->instructions;
+   double start = now();
+   for( int i = 0; i < frames; ++i ) {
+      Nes_DoFrame( nes );
+   }
+   double elapsed = now() - start;
+   cycles = nes->cpu_cycles - cycles;
+   instructions = nes->instructions - instructions;
+
+   printf( "%s    \"%s\": { \"frames_per_sec\": %.1f, \"ns_per_cpu_cycle\": %.3f, \"ns_per_instruction\": %.3f }",
+      first ? "" : ",\n", name, frames / elapsed, elapsed * 1e9 / cycles, elapsed * 1e9 / instructions );
+
+   Nes_Free( nes );
+   Nes_RomRelease( rom );
+}
+
+// Idle loop skipping must leave the very state running every instruction does
+static int idle_skip_matches( void (*program)( Asm *a ), int frames )
+{
+   static Asm a;
+   Nes_Rom *rom, *rom_full;
+   begin( &a );
+   program( &a );
+   Nes *skip = boot( &a, &rom );
+   Nes *full = boot( &a, &rom_full );
+   Nes_SetIdleSkip( full, false );
+   int matches = true;
+   for( int i = 0; i < frames && matches; ++i ) {
+      Nes_DoFrame( skip );
+      Nes_DoFrame( full );
+      matches = memcmp( (byte*) skip + Nes_state_offset, (byte*) full + Nes_state_offset, Nes_state_size ) == 0
+         && memcmp( Nes_GetFramebuffer( skip ), Nes_GetFramebuffer( full ), Nes_screen_width * Nes_screen_height ) == 0;
+   }
+   Nes_Free( skip );
+   Nes_Free( full );
+   Nes_RomRelease( rom );
+   Nes_RomRelease( rom_full );
+   return matches;
+}
+
+// -------------------------------------------------------------------------------
+// Subsystems measured in isolation
+
+static double time_cpu_step( int steps ) // ns per instruction, straight Cpu6502_CpuStep() with no PPU around
+{
+   static Asm a;
+   Nes_Rom *rom;
+   begin( &a );
+   ram_loop( &a );
+   Nes *nes = boot( &a, &rom );
+   double start = now();
+   for( int i = 0; i < steps; ++i ) {
+      Cpu6502_CpuStep( nes->cpu );
+   }
+   double ns = ( now() - start ) * 1e9 / steps;
+   Nes_Free( nes );
+   Nes_RomRelease( rom );
+   return ns;
+}
+
+static double time_memory_dispatch( Nes *nes, int accesses ) // ns per read through the CPU handler tables
+{
+   static const word addresses[8] = { 0x0010, 0x0812, 0x01FF, 0x6000, 0x8000, 0xC123, 0xFFFC, 0x0700 };
+   static volatile unsigned sum; // Keeps the reads from being optimized away
+   double start = now();
+   for( int i = 0; i < accesses; ++i ) {
+      word address = addresses[ i & 7 ];
+      sum += nes->cpu->read_memory[address]( nes, address );
+   }
+   return ( now() - start ) * 1e9 / accesses;
+}
+
+static double time_rom_load( Asm *a, int loads ) // us per ROM parse and attach
+{
+   Nes *nes = Nes_Create();
+   double start = now();
+   for( int i = 0; i < loads; ++i ) {
+      Nes_Rom *rom = Nes_RomFromMemory( a->image, sizeof a->image, Rom_storage_borrowed );
+      Nes_AttachRom( nes, rom );
+      Nes_RomRelease( rom );
+   }
+   double us = ( now() - start ) * 1e6 / loads;
+   Nes_Free( nes );
+   return us;
+}
+
+static double time_chr_unpack( int repeats ) // us per 8kB CHR bank unpacked
+{
+   const int banks = 32; // 256kB of CHR-ROM
+   size_t size = 16 + PRG_ROM_bank_size + banks * CHR_ROM_bank_size;
+   byte *image = (byte*) calloc( size, 1 );
+   memcpy( image, "NES\x1A", 4 );
+   image[4] = 1;
+   image[5] = banks;
+   for( size_t i = 16 + PRG_ROM_bank_size; i < size; ++i ) {
+      image[i] = (byte)( i * 13 );
+   }
+
+   Nes *nes = Nes_Create();
+   double elapsed = 0;
+   for( int r = 0; r < repeats; ++r ) {
+      Nes_Rom *rom = Nes_RomFromMemory( image, size, Rom_storage_borrowed );
+      Nes_AttachRom( nes, rom );
+      double start = now();
+      for( int bank = 0; bank < banks * CHR_banks_per_rom_bank; ++bank ) {
+         Nes_MapChr( nes, 0, bank ); // First map unpacks
+      }
+      elapsed += now() - start;
+      Nes_RomRelease( rom ); // The instance keeps it until the next attach
+   }
+   Nes_Free( nes );
+   free( image );
+   return elapsed * 1e6 / ( repeats * banks );
+}
+
+#define Clone_target_us 0.5 // "Well under a microsecond" per warm clone, not met yet: copying the state block takes most of 1us
+
+// us per Nes_Clone(), taking a warmed pooled instance or, `cold`, creating one with the pool empty
+static double time_clone( Nes *nes, int clones, int cold )
+{
+   double elapsed = 0;
+   for( int i = 0; i < clones; ++i ) {
+      Nes_FreePool();
+      if( ! cold ) {
+         Nes_WarmPool( nes, 1 );
+      }
+      double start = now();
+      Nes *clone = Nes_Clone( nes );
+      elapsed += now() - start;
+      Nes_Free( clone );
+   }
+   Nes_FreePool();
+   return elapsed * 1e6 / clones;
+}
+
+// -------------------------------------------------------------------------------
+int main( int argc, char *argv[] )
+{
+   int frames = ( argc > 1 ) ? atoi( argv[1] ) : 600;
+
+   printf( "{\n  \"frames\": %d,\n  \"workloads\": {\n", frames );
+   run_workload( "ram_loop",    ram_loop,    frames, true, 1 );
+   run_workload( "vram_storm",  vram_storm,  frames, true, 0 );
+   run_workload( "oam_dma",     oam_dma,     frames, true, 0 );
+   run_workload( "status_poll", status_poll, frames, true, 0 );
+   run_workload( "status_poll_no_idle_skip", status_poll, frames, false, 0 );
+   run_workload( "overflow_poll", overflow_poll, frames, true, 0 );
+   printf( "\n  },\n" );
+
+   printf( "  \"idle_skip_matches\": { \"status_poll\": %s, \"overflow_poll\": %s },\n",
+      idle_skip_matches( status_poll, frames ) ? "true" : "false", idle_skip_matches( overflow_poll, frames ) ? "true" : "false" );
+
+   static Asm a;
+   Nes_Rom *rom;
+   begin( &a );
+   ram_loop( &a );
+   Nes *nes = boot( &a, &rom );
+   printf( "  \"subsystems\": {\n" );
+   printf( "    \"cpu_step_ns\": %.3f,\n", time_cpu_step( 10000000 ) );
+   printf( "    \"memory_dispatch_ns\": %.3f,\n", time_memory_dispatch( nes, 50000000 ) );
+   printf( "    \"chr_unpack_us_per_8kb\": %.3f,\n", time_chr_unpack( 20 ) );
+   printf( "    \"rom_load_us\": %.3f,\n", time_rom_load( &a, 2000 ) );
+   double clone_warm_us = time_clone( nes, 500, 0 );
+   printf( "    \"clone_warm_us\": %.3f,\n", clone_warm_us );
+   printf( "    \"clone_cold_us\": %.3f,\n", time_clone( nes, 500, 1 ) );
+   printf( "    \"clone_target_us\": %.3f,\n", Clone_target_us );
+   printf( "    \"clone_target_met\": %s\n", clone_warm_us < Clone_target_us ? "true" : "false" );
+   printf( "  }\n}\n" );
+   Nes_Free( nes );
+   Nes_RomRelease( rom );
+   return 0;
+}